@@ -1,11 +1,40 @@
 #include <vector>
+#include <array>
 #include <string>
 #include <ctime>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
 #include <algorithm>
 #include <iostream>
 #include <cmath>
+#include <limits>
 #include <queue>
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <fstream>
+#include <cstdint>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef ALLOC_STATS
+#include <malloc.h>
+#endif
 #include "jsoncpp/json.h" // 在平台上，C++编译时默认包含此库
 #define LOCAL_DEBUG
 
@@ -30,6 +59,12 @@ namespace doudizhu
     // 牌张按照3-JOKER的顺序从0-53编号
     typedef int Card;
 
+    // 各种牌的数目（下标为牌张类型），放在栈上，不做堆分配
+    typedef array<int, MAX_CARD_TYPE_NUM> CardCounter;
+
+    // 三家的手牌，下标i对应搜索局面中的第i家
+    typedef array<EncodedCards, 3> PlayerHands;
+
     // 定义牌张类型：一共15种不同大小的牌
     typedef enum
     {
@@ -70,24 +105,279 @@ namespace doudizhu
     // 某种主牌类型要想形成合法序列（顺子、连对、飞机、连炸），所需的最小长度
     const int SEQ_MIN_LENGTH[] = {0, 5, 3, 2, 2, 1};
 
-    //全局记录当前轮数三位玩家的历史出牌记录
-    int turn;
-    vector<EncodedCards> history_combo[3];
-    //全局记录当前轮数三位玩家需要压的牌型
-    vector<vector<EncodedCards>> history_last_action(3, vector<EncodedCards>(0));
-    //全局记录未知的另外两位玩家的手牌，
-    vector<int> unknown_cards(MAX_CARD_TYPE_NUM);
-    vector<int> full_cards(MAX_CARD_TYPE_NUM);
-    vector<int> my_initial_cards_counter(MAX_CARD_TYPE_NUM);
-    EncodedCards encoded_my_initial_cards;
-    //另外两家已经出的牌，用于sample 函数中
-    EncodedCards cards_played_a = 0, cards_played_b = 0, cards_played_c;
-    // a 是下家, b 是上家
-    int player_a, player_b;
-    //后验分布的cdf
-    vector<double> cumulative_probability;
-    // player a 可能的手牌
-    vector<EncodedCards> possible_hands_a;
+    // 一次决策的各个阶段：解析输入、构造后验、抽取确定化、搜索、输出结果并释放缓冲。
+    // 决策之外的时间（预想线程、基准测试的准备等）记在PHASE_OTHER下
+    enum DecisionPhase
+    {
+        PHASE_OTHER = 0,
+        PHASE_PARSE = 1,
+        PHASE_POSTERIOR = 2,
+        PHASE_SAMPLING = 3,
+        PHASE_SEARCH = 4,
+        PHASE_TEARDOWN = 5,
+        PHASE_NUM = 6
+    };
+    const char *const PHASE_NAMES[PHASE_NUM] = {"other", "parse", "posterior", "sampling", "search", "teardown"};
+
+    // 以-DALLOC_STATS编译时，除了分配次数，还对每次new/delete查询块的大小，统计字节数、释放次数和存活堆的峰值
+#ifdef ALLOC_STATS
+    const bool ALLOC_BYTES_TRACKED = true;
+#else
+    const bool ALLOC_BYTES_TRACKED = false;
+#endif
+
+    // 是否在全局的operator new/delete中统计堆分配，由--alloc-stats或--bench-alloc打开。
+    // 关闭时new/delete只多一次判断，决策的各阶段分配次数均为0
+    bool count_allocations = false;
+
+    // 正在进行的决策数，以及进程启动以来开始过的决策数，用于判断一次决策期间有没有其他决策同时进行
+    atomic<int> active_decisions(0);
+    atomic<long long> decision_starts(0);
+    // 进程的存活堆字节数及其峰值，只在ALLOC_STATS下统计。存活堆是全进程共享的，
+    // 所以峰值只对没有与其他决策重叠的决策有意义
+    atomic<long long> live_heap_bytes(0), peak_heap_bytes(0);
+
+    // 一次决策的分配计数器，按该决策当前所处的阶段分别累计
+    struct AllocCounters
+    {
+        atomic<int> phase;
+        atomic<long long> allocs[PHASE_NUM], frees[PHASE_NUM], bytes[PHASE_NUM];
+    };
+
+    // 一次决策中各阶段的耗时和堆分配（字节数和释放次数只在ALLOC_STATS下统计），
+    // 决策期间存活堆的峰值（与其他决策重叠或没有统计时为-1），以及同时存在的搜索树占用的内存（按容量计）。
+    // begin()之后，本线程以及替本线程执行线程池任务、构造后验的线程上的分配都计入counters
+    struct AllocReport
+    {
+        AllocCounters counters;
+        double ms[PHASE_NUM];
+        long long allocs[PHASE_NUM], frees[PHASE_NUM], bytes[PHASE_NUM];
+        long long peak_live_bytes, tree_bytes;
+        // 当前阶段的开始时刻
+        chrono::steady_clock::time_point since;
+        // 本次决策开始时的决策编号、是否与其他决策重叠，以及begin()之前本线程的统计对象
+        long long started;
+        bool overlapped;
+        AllocReport *previous;
+
+        AllocReport() : peak_live_bytes(-1), tree_bytes(0), started(0), overlapped(false), previous(NULL)
+        {
+            clear();
+        }
+
+        void clear()
+        {
+            counters.phase.store(PHASE_OTHER);
+            for (int p = 0; p < PHASE_NUM; p++)
+            {
+                counters.allocs[p].store(0);
+                counters.frees[p].store(0);
+                counters.bytes[p].store(0);
+                ms[p] = 0;
+                allocs[p] = frees[p] = bytes[p] = 0;
+            }
+            peak_live_bytes = -1;
+            tree_bytes = 0;
+        }
+
+        // 开始统计本线程上的一次决策
+        void begin();
+        // 切换到下一阶段，上一阶段的耗时计入ms
+        void enter(DecisionPhase phase)
+        {
+            auto now = chrono::steady_clock::now();
+            ms[counters.phase.exchange(phase)] += chrono::duration<double, milli>(now - since).count();
+            since = now;
+        }
+        // 结束统计：回到PHASE_OTHER，取出各阶段的计数，恢复本线程原来的统计对象
+        void end();
+    };
+
+    // 本线程上的分配计入的决策，NULL表示不计入任何决策
+    thread_local AllocReport *alloc_report = NULL;
+
+    void AllocReport::begin()
+    {
+        clear();
+        previous = alloc_report;
+        alloc_report = this;
+        started = decision_starts.fetch_add(1) + 1;
+        overlapped = active_decisions.fetch_add(1) > 0;
+        // 有其他决策同时进行时不重置峰值，否则会破坏对方的统计
+        if (ALLOC_BYTES_TRACKED && !overlapped)
+            peak_heap_bytes.store(live_heap_bytes.load());
+        since = chrono::steady_clock::now();
+    }
+
+    void AllocReport::end()
+    {
+        enter(PHASE_OTHER);
+        for (int p = 0; p < PHASE_NUM; p++)
+        {
+            allocs[p] = counters.allocs[p].load();
+            frees[p] = counters.frees[p].load();
+            bytes[p] = counters.bytes[p].load();
+        }
+        // 期间有其他决策开始过，同样算作重叠
+        overlapped = overlapped || decision_starts.load() != started;
+        active_decisions.fetch_sub(1);
+        peak_live_bytes = ALLOC_BYTES_TRACKED && !overlapped ? peak_heap_bytes.load() : -1;
+        alloc_report = previous;
+    }
+
+    // 根节点某个动作在若干次采样中的平均得分之和、平方和，以及得分的个数
+    struct RootStat
+    {
+        double sum, sum_sq;
+        int count;
+        RootStat() : sum(0), sum_sq(0), count(0) {}
+    };
+
+    // 一次UCTSearch（一个采样）的统计，只在记录遥测时收集
+    struct TreeStats
+    {
+        bool done;
+        int nodes, max_depth;
+        double mean_depth;
+        // 已展开子节点的非终局节点平均展开了多少个子节点（有效分支因子），以及它们平均有多少个合法动作
+        double branching, width;
+        // 采样和搜索的耗时
+        double sample_ms, search_ms;
+        // 这棵树选出的动作，以及根节点各动作的访问次数
+        EncodedCards best;
+        vector<pair<EncodedCards, double> > root_visits;
+        TreeStats() : done(false), nodes(0), max_depth(0), mean_depth(0), branching(0), width(0), sample_ms(0), search_ms(0), best(0) {}
+    };
+
+    // 流水线模式下，后验分布完成之前在部分后验上搜索的一个采样
+    struct EarlySample
+    {
+        // 采样得到的下家初始手牌，以及该采样选出的动作和得分
+        EncodedCards hand_a, best;
+        double value;
+        // 采样时部分后验的归一化常数；后验完成后换成重要性权重
+        double weight;
+        // 根节点各动作（按编码排序）的访问次数与总得分
+        vector<double> N, W;
+    };
+
+    // 线程数，1表示不创建额外线程
+    int thread_num = 1;
+
+    // 简单的线程池。parallelFor把[0, n)的任务分给所有线程（包括调用者）执行，返回时任务全部完成；
+    // fn(task, worker)中worker为执行线程的编号，范围是[0, size())。
+    // 在线程池的任务内部再次调用parallelFor时直接在当前线程顺序执行，避免死锁
+    class ThreadPool
+    {
+    public:
+        explicit ThreadPool(int threads) : job(NULL), job_report(NULL), job_size(0), next_task(0), active(0), generation(0), stopping(false)
+        {
+            for (int i = 1; i < threads; i++)
+                workers.push_back(thread(&ThreadPool::workerLoop, this, i));
+        }
+
+        ~ThreadPool()
+        {
+            {
+                lock_guard<mutex> lock(m);
+                stopping = true;
+            }
+            job_ready.notify_all();
+            for (thread &t : workers)
+                t.join();
+        }
+
+        int size() const
+        {
+            return workers.size() + 1;
+        }
+
+        void parallelFor(int n, const function<void(int, int)> &fn)
+        {
+            if (n <= 0)
+                return;
+            if (workers.empty() || inTask())
+            {
+                for (int i = 0; i < n; i++)
+                    fn(i, 0);
+                return;
+            }
+            // 同一时间只允许一个调用者使用线程池
+            lock_guard<mutex> caller(call_mutex);
+            {
+                lock_guard<mutex> lock(m);
+                job = &fn;
+                job_report = alloc_report;
+                job_size = n;
+                next_task = 0;
+                active = workers.size();
+                generation++;
+            }
+            job_ready.notify_all();
+            runTasks(0);
+            unique_lock<mutex> lock(m);
+            job_done.wait(lock, [this] { return active == 0; });
+            job = NULL;
+        }
+
+    private:
+        vector<thread> workers;
+        mutex m, call_mutex;
+        condition_variable job_ready, job_done;
+        const function<void(int, int)> *job;
+        // 调用者的分配统计对象，执行任务的线程上的分配也计入其中
+        AllocReport *job_report;
+        int job_size;
+        atomic<int> next_task;
+        int active;
+        unsigned long long generation;
+        bool stopping;
+
+        static bool &inTask()
+        {
+            static thread_local bool in_task = false;
+            return in_task;
+        }
+
+        void runTasks(int worker)
+        {
+            inTask() = true;
+            AllocReport *saved = alloc_report;
+            alloc_report = job_report;
+            for (int i = next_task++; i < job_size; i = next_task++)
+                (*job)(i, worker);
+            alloc_report = saved;
+            inTask() = false;
+        }
+
+        void workerLoop(int worker)
+        {
+            unsigned long long seen = 0;
+            while (true)
+            {
+                {
+                    unique_lock<mutex> lock(m);
+                    job_ready.wait(lock, [&] { return stopping || generation != seen; });
+                    if (stopping)
+                        return;
+                    seen = generation;
+                }
+                runTasks(worker);
+                lock_guard<mutex> lock(m);
+                if (--active == 0)
+                    job_done.notify_all();
+            }
+        }
+    };
+
+    // 全局线程池，按thread_num创建；thread_num改变后（只在两次搜索之间由主线程修改）重建
+    ThreadPool &threadPool()
+    {
+        static unique_ptr<ThreadPool> pool;
+        if (!pool || pool->size() != thread_num)
+            pool.reset(new ThreadPool(thread_num));
+        return *pool;
+    }
 
     // 返回具体牌张的类型：（0-14编号，对应于THREE, FOUR,... Joker, JOKER）
     inline CardType cardTypeOf(Card c)
@@ -95,10 +385,10 @@ namespace doudizhu
         return CardType((c >> 2) + int(bool(c & 1) && (c >= MAX_CARD_NUM - 2))); // if c == 53, then the cardType is c/4 + 1.
     }
 
-    // 将牌张序列转为各种牌的数目向量
-    vector<int> toCardCountVector(const vector<Card> &card_combo)
+    // 将牌张序列转为各种牌的数目
+    CardCounter toCardCounter(const vector<Card> &card_combo)
     {
-        vector<int> card_counter(MAX_CARD_TYPE_NUM);
+        CardCounter card_counter = {};
         for (Card c : card_combo)
         {
             card_counter[cardTypeOf(c)]++;
@@ -106,8 +396,8 @@ namespace doudizhu
         return card_counter;
     }
 
-    // 将各种牌的数目向量转为EncodedCards表示
-    EncodedCards toEncodedCards(const vector<int> &card_counter)
+    // 将各种牌的数目转为EncodedCards表示
+    EncodedCards toEncodedCards(const CardCounter &card_counter)
     {
         EncodedCards combo = NO_CARDS;
         for (CardType i = START_CARD; i <= JOKER; i = CardType(i + 1))
@@ -119,9 +409,9 @@ namespace doudizhu
     }
 
     //将EncodedCard转化为CardCounter
-    vector<int> encodedCardsToCardCountVector(EncodedCards card_combo)
+    CardCounter encodedCardsToCardCounter(EncodedCards card_combo)
     {
-        vector<int> card_counter(MAX_CARD_TYPE_NUM);
+        CardCounter card_counter = {};
         for (CardType i = START_CARD; i <= JOKER; i = CardType(i + 1))
         {
             card_counter[i] = (card_combo >> (i << 2)) & 0xf;
@@ -129,6 +419,9 @@ namespace doudizhu
         return card_counter;
     }
 
+    // 整副牌各种牌的数目
+    const CardCounter full_cards = encodedCardsToCardCounter(FULL_CARDS);
+
     // 在EncodedCards combo中将CardType ct类型的牌的数目增加n
     inline EncodedCards addToEncodedCards(
         CardType ct, EncodedCards combo, int n = 1)
@@ -151,24 +444,166 @@ namespace doudizhu
     }
 
 
-    bool isFinished(const vector<EncodedCards> &state)
+    // 有一家的牌已经出完
+    bool isFinished(const PlayerHands &state)
     {
-        bool flag;
-        for (EncodedCards cards: state)
+        return state[0] == NO_CARDS || state[1] == NO_CARDS || state[2] == NO_CARDS;
+    }
+
+    // 对两个对手手牌的信念：对每种牌，下家初始持有0-4张的后验边缘概率。两家初始合计的张数是已知的，
+    // 所以上家的张数由下家唯一确定。由后验分布算一次（O(后验手牌数×牌种)）；之后每观察到一手出牌，
+    // 只按"出的牌必须在手里"截断并重新归一化（O(牌种)），不必重建后验。按张数、牌种的查询直接查表。
+    // 不同种牌之间按相互独立处理，这是对联合分布的近似，
+    // 但概率为0的结论是精确的：只有后验中没有任何手牌满足条件时才会得到0
+    struct BeliefTracker
+    {
+        // initial[t][k]: 下家初始持有k张第t种牌的概率
+        double initial[MAX_CARD_TYPE_NUM][5];
+        // 两家初始合计的张数，以及两家（0下家，1上家）已经出过的张数
+        int total[MAX_CARD_TYPE_NUM];
+        int played[2][MAX_CARD_TYPE_NUM];
+        // at_least[p][t][n]: 对手p现在至少有n张第t种牌的概率
+        double at_least[2][MAX_CARD_TYPE_NUM][5];
+        // none_above[p][n][t]: 对手p在比t大的牌（不含t）中没有任何一种有n张及以上的概率
+        double none_above[2][5][MAX_CARD_TYPE_NUM];
+        // 对手p手里有火箭的概率
+        double rocket[2];
+
+        BeliefTracker()
+        {
+            memset(this, 0, sizeof(BeliefTracker));
+        }
+
+        // 由后验分布（下家可能的初始手牌及其cdf）和我的初始手牌构造，此时还没有计入任何出牌
+        void build(const vector<EncodedCards> &hands, const vector<double> &cdf, EncodedCards my_initial_cards)
+        {
+            memset(initial, 0, sizeof(initial));
+            memset(played, 0, sizeof(played));
+            double prev = 0;
+            for (size_t i = 0; i < hands.size(); i++)
+            {
+                double p = cdf[i] - prev;
+                prev = cdf[i];
+                for (CardType t = THREE; t <= JOKER; t = CardType(t + 1))
+                    initial[t][numCardOfEncoded(t, hands[i])] += p;
+            }
+            for (CardType t = THREE; t <= JOKER; t = CardType(t + 1))
+                total[t] = full_cards[t] - numCardOfEncoded(t, my_initial_cards);
+            update();
+        }
+
+        // 对手p（0下家，1上家）打出了combo
+        void observe(int p, EncodedCards combo)
         {
-            vector<int> card_counter = encodedCardsToCardCountVector(cards);
-            flag = true;
-            for (int i=0;i<card_counter.size();i++)
-                if(card_counter[i])
+            for (CardType t = THREE; t <= JOKER; t = CardType(t + 1))
+                played[p][t] += numCardOfEncoded(t, combo);
+            update();
+        }
+
+        // 去掉与已出的牌矛盾的取值，重新归一化并重算查询表
+        void update()
+        {
+            for (int t = 0; t < MAX_CARD_TYPE_NUM; t++)
+            {
+                double sum = 0;
+                for (int k = 0; k <= 4; k++)
                 {
-                    flag = false;
-                    break;
+                    if (k < played[0][t] || total[t] - k < played[1][t])
+                        initial[t][k] = 0;
+                    sum += initial[t][k];
                 }
-            if (flag)
-                return true;
+                for (int k = 0; k <= 4 && sum > 0; k++)
+                    initial[t][k] /= sum;
+                for (int n = 0; n <= 4; n++)
+                {
+                    at_least[0][t][n] = at_least[1][t][n] = 0;
+                    for (int k = 0; k <= 4; k++)
+                    {
+                        if (k - played[0][t] >= n)
+                            at_least[0][t][n] += initial[t][k];
+                        if (total[t] - k - played[1][t] >= n)
+                            at_least[1][t][n] += initial[t][k];
+                    }
+                }
+            }
+            for (int p = 0; p < 2; p++)
+            {
+                for (int n = 0; n <= 4; n++)
+                {
+                    double none = 1;
+                    for (int t = MAX_CARD_TYPE_NUM - 1; t >= 0; t--)
+                    {
+                        none_above[p][n][t] = none;
+                        none *= 1 - at_least[p][t][n];
+                    }
+                }
+                rocket[p] = at_least[p][Joker][1] * at_least[p][JOKER][1];
+            }
         }
-        return false;
-    }
+
+        // 对手p现在至少有n张第t种牌的概率
+        double probAtLeast(int p, CardType t, int n) const
+        {
+            return at_least[p][t][n];
+        }
+    };
+
+    // 一局游戏（一次决策请求）的全部状态。每个请求使用各自的GameContext，因此一个进程可以并发处理多个请求
+    struct GameContext
+    {
+        //当前轮数三位玩家的历史出牌记录
+        int turn;
+        vector<EncodedCards> history_combo[3];
+        //当前轮数三位玩家需要压的牌型
+        vector<vector<EncodedCards>> history_last_action;
+        //未知的另外两位玩家的手牌，
+        CardCounter unknown_cards;
+        CardCounter my_initial_cards_counter;
+        EncodedCards encoded_my_initial_cards;
+        //另外两家已经出的牌，用于sample 函数中
+        EncodedCards cards_played_a, cards_played_b, cards_played_c;
+        // a 是下家, b 是上家
+        int player_a, player_b;
+        //后验分布的cdf
+        vector<double> cumulative_probability;
+        // player a 可能的手牌
+        vector<EncodedCards> possible_hands_a;
+
+        // 枚举后验分布过程中见到的最大似然，各线程共享
+        atomic<double> posterior_best_weight;
+        // posterior_capacity[t]: a在第t种及之后的牌中最多还能再拿多少张，用于提前剪掉凑不满手牌数的子树
+        int posterior_capacity[MAX_CARD_TYPE_NUM + 1];
+        // 构造后验分布时枚举到的手牌数、保留的手牌数和耗时（毫秒）
+        int posterior_enumerated, posterior_kept;
+        double posterior_build_ms;
+        // 保留下来的手牌的似然之和（归一化常数）
+        double posterior_mass;
+        // 流水线模式下后验完成之前的采样，DetMCTS按其中的重要性权重计入汇总
+        vector<EarlySample> early_samples;
+        // 由后验分布得到的对手手牌信念，构造后验之后按对局记录计入两家的出牌
+        BeliefTracker beliefs;
+        // 轮到我之前连续pass的次数，以及我需要压的牌
+        int root_passes;
+        EncodedCards root_last_action;
+        // 预想阶段得到的根节点各动作的统计（可以为NULL），逐次减半时作为先验计入；以及预想的采样数
+        const map<EncodedCards, RootStat> *root_prior;
+        int prior_samples;
+        // 搜索中单棵树节点数的峰值，以及在时间预算内完成的采样数
+        int search_peak_nodes, search_samples;
+        // 去重之后实际搜索的确定化数目
+        int search_determinizations;
+        // 本次决策各阶段的耗时和堆分配
+        AllocReport alloc;
+        // 为真时收集每个采样的搜索统计，tree_stats按采样编号存放
+        bool collect_telemetry;
+        vector<TreeStats> tree_stats;
+
+        GameContext() : turn(0), history_last_action(3), unknown_cards(), my_initial_cards_counter(),
+                        encoded_my_initial_cards(0), cards_played_a(0), cards_played_b(0), cards_played_c(0), player_a(0), player_b(0),
+                        posterior_best_weight(0), posterior_enumerated(0), posterior_kept(0), posterior_build_ms(0), posterior_mass(0),
+                        root_passes(0), root_last_action(0), root_prior(NULL), prior_samples(0),
+                        search_peak_nodes(0), search_samples(0), search_determinizations(0), collect_telemetry(false) {}
+    };
 
     // 分析一手牌的类型、大小等
     struct Hand
@@ -186,10 +621,13 @@ namespace doudizhu
 
         // 解析对手的一手牌（牌张编码、主牌类型、主牌开始、主牌长度、副牌所带数目）
         // card_counter表示这一手牌每种有多少张
-        Hand(const vector<int> &card_counter)
+        Hand(const CardCounter &card_counter) : Hand(toEncodedCards(card_counter)) {}
+
+        // 直接解析编码形式的一手牌，不需要构造数目向量
+        explicit Hand(EncodedCards encoded)
         {
-            // 初始化这一手牌的编码形式为空
-            combo = NO_CARDS;
+            // 这一手牌的编码形式
+            combo = encoded;
             // 最多的牌是哪一种（取最先出现的那一种）
             CardType max_freq_card = START_CARD;
             // 最多出现的牌出现了多少次
@@ -200,25 +638,24 @@ namespace doudizhu
             CardType min_card = JOKER;
             // 这一手牌一共有多少张
             int total_cards = 0;
-            // 编码对手这一手牌到位图中
-            combo = toEncodedCards(card_counter);
             // 扫一遍对手的牌，看看出现次数最多的牌、主牌的长度
             for (CardType i = START_CARD; i <= JOKER; i = CardType(i + 1))
             {
-                total_cards += card_counter[i];
+                int count = numCardOfEncoded(i, encoded);
+                total_cards += count;
                 // 记录出现次数最多的牌是哪一种，及其出现次数
-                if (card_counter[i] > max_freq)
+                if (count > max_freq)
                 {
-                    max_freq = card_counter[i];
+                    max_freq = count;
                     max_freq_card = i;
                     max_freq_length = 1;
                 }
-                else if (card_counter[i] == max_freq)
+                else if (count == max_freq)
                 {
                     max_freq_length++;
                 }
                 // 记录出现的最小牌张
-                if (card_counter[i] != 0 && i < min_card)
+                if (count != 0 && i < min_card)
                 {
                     min_card = i;
                 }
@@ -294,7 +731,121 @@ namespace doudizhu
     // Check if a card combo is PASS
     bool isPass(EncodedCards combo)
     {
-        return Hand(encodedCardsToCardCountVector(combo)).isPass();
+        return combo == NO_CARDS;
+    }
+
+    // 裁判：不枚举动作，直接由Hand的牌型分析判断，每个函数只扫一遍15种牌。
+    // 牌型规则：序列不含2和王，长度不小于SEQ_MIN_LENGTH；三张、四张（及其序列）可以不带，
+    // 也可以每组三张带一种、每组四张带两种副牌，副牌与主牌不同种、彼此不同种，并且都是单张或者都是对子
+
+    // 手牌hand是否包含combo。每种牌至多4张，置上每4位的最高位后逐种相减不会借位
+    inline bool containsCards(EncodedCards hand, EncodedCards combo)
+    {
+        const EncodedCards high = 0x8888888888888888ull;
+        return (((hand | high) - combo) & high) == high;
+    }
+
+    // combo是否是一手成立的牌（不含pass）
+    bool isValidCombo(EncodedCards combo)
+    {
+        if (combo == NO_CARDS)
+            return false;
+        Hand hand(combo);
+        if (hand.isRocket())
+            return true;
+        CardType end = CardType(hand.start + hand.length - 1);
+        if (hand.length > 1 && (hand.length < SEQ_MIN_LENGTH[hand.type] || end > ACE))
+            return false;
+        // 主牌必须是从start开始连续的length种、每种type张，其余的都是副牌
+        int appendix_kinds = 0, appendix_size = 0;
+        for (CardType i = START_CARD; i <= JOKER; i = CardType(i + 1))
+        {
+            int count = numCardOfEncoded(i, combo);
+            if (i >= hand.start && i <= end)
+            {
+                if (count != int(hand.type))
+                    return false;
+            }
+            else if (count)
+            {
+                if (appendix_size && count != appendix_size)
+                    return false;
+                appendix_size = count;
+                appendix_kinds++;
+            }
+        }
+        if (!appendix_kinds)
+            return true;
+        if (appendix_size > 2 || hand.type < TRIPLET)
+            return false;
+        return appendix_kinds == hand.length * (hand.type == TRIPLET ? 1 : 2);
+    }
+
+    // 两手成立的牌，combo能否压过last
+    bool beats(EncodedCards combo, EncodedCards last)
+    {
+        Hand mine(combo), theirs(last);
+        if (theirs.isRocket())
+            return false;
+        if (mine.isRocket())
+            return true;
+        if (mine.isBomb() != theirs.isBomb())
+            return mine.isBomb();
+        return mine.type == theirs.type && mine.length == theirs.length && mine.appendix == theirs.appendix && mine.start > theirs.start;
+    }
+
+    // 需要压last（NO_CARDS表示自由出牌）时能否出combo，不考虑出牌者的手牌
+    bool isLegalResponse(EncodedCards combo, EncodedCards last)
+    {
+        if (combo == NO_CARDS)
+            return last != NO_CARDS;
+        return isValidCombo(combo) && (last == NO_CARDS || beats(combo, last));
+    }
+
+    // 手牌为hand、需要压last时能否出combo
+    bool isLegalPlay(EncodedCards hand, EncodedCards combo, EncodedCards last)
+    {
+        return containsCards(hand, combo) && isLegalResponse(combo, last);
+    }
+
+    // 对手p（0下家，1上家）能压过last的概率，按BeliefTracker的独立性近似计算。
+    // 只看主牌，不检查副牌是否凑得出，因此是偏大的估计。单张、对子、三张、炸弹直接查表；
+    // 序列要对更大的起点做一遍O(牌种)的递推，只用栈上的定长数组
+    double probCanBeat(const BeliefTracker &beliefs, int p, EncodedCards last)
+    {
+        Hand hand(last);
+        if (hand.isPass())
+            return 1;
+        if (hand.isRocket())
+            return 0;
+        // 没有更大的炸弹，也没有火箭（none_above[p][4][THREE]已经包含了所有牌张）
+        double no_bomb = (hand.isBomb() ? beliefs.none_above[p][4][hand.start]
+                                        : beliefs.none_above[p][4][THREE] * (1 - beliefs.probAtLeast(p, THREE, 4))) *
+                         (1 - beliefs.rocket[p]);
+        if (hand.isBomb())
+            return 1 - no_bomb;
+        int n = hand.type;
+        double no_main;
+        if (hand.length == 1)
+            no_main = beliefs.none_above[p][n][hand.start];
+        else
+        {
+            // no_run[j]: 到当前牌为止，末尾恰有j种连续的牌都有n张以上、且还没有凑成长度length的序列的概率
+            double no_run[MAX_CARD_TYPE_NUM] = {1};
+            for (CardType t = CardType(hand.start + 1); t <= ACE; t = CardType(t + 1))
+            {
+                double q = beliefs.probAtLeast(p, t, n), rest = 0;
+                for (int j = 0; j < hand.length; j++)
+                    rest += no_run[j];
+                for (int j = hand.length - 1; j > 0; j--)
+                    no_run[j] = no_run[j - 1] * q;
+                no_run[0] = rest * (1 - q);
+            }
+            no_main = 0;
+            for (int j = 0; j < hand.length; j++)
+                no_main += no_run[j];
+        }
+        return 1 - no_main * no_bomb;
     }
 
     // 使用上一手牌、我方现有的牌，构造游戏状态。可分析我方可行动作
@@ -303,18 +854,18 @@ namespace doudizhu
         // 轮到我出的时候，我有什么牌
         vector<Card> my_cards;
         // 我各种牌都有多少张
-        vector<int> my_card_counter;
+        CardCounter my_card_counter;
         // 上一手出了什么牌
         Hand last_action;
 
         // 传入我有的牌、对手上一次出的牌（0-53）编码
         DoudizhuState(vector<Card> mine, const vector<Card> &last) : my_cards(mine),
-                                                                     my_card_counter(toCardCountVector(mine)),
-                                                                     last_action(toCardCountVector(last)) {}
+                                                                     my_card_counter(toCardCounter(mine)),
+                                                                     last_action(toCardCounter(last)) {}
         // 只传入牌的编码和last action, 注意此时不能使用decodeAction 函数
         DoudizhuState(EncodedCards mine, EncodedCards last) : my_cards(),
-                                                              my_card_counter(encodedCardsToCardCountVector(mine)),
-                                                              last_action(encodedCardsToCardCountVector(last)) {}
+                                                              my_card_counter(encodedCardsToCardCounter(mine)),
+                                                              last_action(last) {}
         // 我的牌中是否有火箭，如果有，则返回该牌型的EncodedCards表示
         EncodedCards genRocket()
         {
@@ -411,9 +962,9 @@ namespace doudizhu
                     }
                 }
                 // accumulated_length[1,2,3,4]: 统计到某种牌时，记录以其为结尾的最长（单/对/三/四）连牌长度
-                vector<int> accumulated_length(5);
+                int accumulated_length[5] = {};
                 // 暂时保存action的值
-                vector<EncodedCards> a(5);
+                EncodedCards a[5] = {};
                 // 生成连续牌：连单、连双、连三（带）、连四（带）
                 for (CardType i = START_CARD; i <= ACE; i = CardType(i + 1))
                 {
@@ -434,12 +985,14 @@ namespace doudizhu
                     // 考虑连单、双、三、四的序列
                     for (int j = 1, num_appendixes; j <= 4; ++j)
                     {
+                        // 枚举子序列时在副本上逐个去掉开头，a[j]本身要留给后续以i+1结尾的序列继续累加
+                        EncodedCards sequence = a[j];
                         // 当前序列以i结尾，开头位于i-accumulated_length[j]+1处
                         for (CardType k = CardType(i - accumulated_length[j] + 1);
                              // j重的牌序列最短长度要大于等于SEQ_MIN_LENGTH[j]，因此k最多到i-SEQ_MIN_LENGTH[j]+1
                              k <= i - SEQ_MIN_LENGTH[j] + 1; k = CardType(k + 1))
                         {
-                            action = a[j];
+                            action = sequence;
                             if (generate_appendix && j >= 3)
                             {
                                 // 如果j=3，那么需要为每段生成一份副牌，如果j=4，那么需要为每段生成2份副牌
@@ -462,7 +1015,7 @@ namespace doudizhu
                                 actions.push_back(action);
                             }
                             // 考虑过k开始到i-SEQ_MIN_LENGTH[j]+1的子序列后，考虑从k+1开始的子序列
-                            a[j] = minusFromEncodedCards(k, a[j], j);
+                            sequence = minusFromEncodedCards(k, sequence, j);
                         }
                     }
                 }
@@ -621,8 +1174,8 @@ namespace doudizhu
                 seq_length = last_action.length;
                 // 四带副牌部分为2单或者2对
                 num_appendixes = 2;
-                // 四带副牌部分为单还是双
-                appendix_type = last_action.appendix;
+                // 四带副牌部分为单还是双：每组四张带两份副牌，appendix是两份的总张数
+                appendix_type = last_action.appendix / 2;
             }
             else if (last_action.isPass())
             {
@@ -710,390 +1263,2797 @@ namespace doudizhu
             return action;
         }
     };
-    double evaluate_each_player(vector<int> card)
-    // card是该玩家手里的牌，类似于mycardcounter
+    // 迷你牌堆手牌的完美散列：混合进制编号，NINE..TWO每种0-4张各占一个5进制位，两张王各占一个2进制位，
+    // 编号范围为[0, MINI_DECK_HANDS)，子手牌的编号都更小。只在START_CARD为NINE（迷你斗地主）时可用
+    const int MINI_DECK_HANDS = 78125 * 2 * 2;
+    const bool MINI_DECK = START_CARD == NINE;
+
+    inline int miniDeckIndex(EncodedCards hand)
     {
-        double value = 0;
-        int triplet_num = 0;
-        int hand_num = 0; //这些牌在理想情况下几手可以出完
-        //评估每一个人的手牌的value value越大说明他的牌越好
-        //有王炸
-        if (card[Joker] == 1 && card[JOKER] == 1)
+        int index = 0, radix = 1;
+        for (CardType i = START_CARD; i <= JOKER; i = CardType(i + 1))
         {
-            value += 130; //后期调参
-            hand_num++;
+            index += numCardOfEncoded(i, hand) * radix;
+            radix *= full_cards[i] + 1;
         }
-        else if (card[Joker] == 1)
+        return index;
+    }
+
+    // 手牌张数
+    inline int cardCount(EncodedCards hand)
+    {
+        int count = 0;
+        for (; hand; hand >>= 4)
+            count += hand & 0xf;
+        return count;
+    }
+
+    // 离线生成的迷你牌堆动作表。每手牌（不超过max_hand_cards张）的动作按"形状"（主牌类型、长度、副牌）分段存放：
+    //   LEAD_SHAPE段是自由出牌时的全部动作；
+    //   其余每个形状一段，是压这种形状时能出的非炸弹动作，按主牌起点递增，另存每个动作的主牌起点；
+    //   TAIL_SHAPE段是手里的炸弹和火箭。
+    // 压一手牌时的动作 = pass + 该形状中起点更大的动作 + 炸弹火箭（压炸弹时只取更大的炸弹和火箭），
+    // 与validActions生成的顺序完全一致。文件由--build-action-table生成，运行时用mmap只读映射，
+    // 没有加载、不是迷你牌堆、手牌张数超出表的范围或不生成副牌时由调用者退回到生成器
+    struct ActionTableHeader
+    {
+        char magic[8];
+        uint32_t version, start_card, max_hand_cards, hand_slots, shape_count, segment_count, action_count, pad;
+        // 各部分相对文件开头的偏移
+        uint64_t shapes_offset, first_segment_offset, segments_offset, actions_offset, starts_offset;
+    };
+
+    struct ActionShape
+    {
+        uint8_t type, length, appendix, pad;
+    };
+
+    struct ActionSegment
+    {
+        uint32_t begin;
+        uint16_t count;
+        uint8_t shape, pad;
+    };
+
+    const char ACTION_TABLE_MAGIC[8] = {'D', 'D', 'Z', 'A', 'C', 'T', 'B', 'L'};
+    const uint32_t ACTION_TABLE_VERSION = 2;
+    const uint8_t LEAD_SHAPE = 0, TAIL_SHAPE = 255;
+    // 表中手牌的最大张数：地主的初始手牌为12张
+    const int ACTION_TABLE_MAX_CARDS = 12;
+
+    class ActionTable
+    {
+    public:
+        ActionTable() : data(NULL), length(0)
         {
-            value += 40;
-            hand_num++;
+            memset(shape_ids, -1, sizeof(shape_ids));
         }
-        else if (card[JOKER] == 1)
+        ~ActionTable()
         {
-            value += 48;
-            hand_num++;
+            if (data)
+                munmap(data, length);
         }
-        for (CardType i = START_CARD; i <= TWO; i = CardType(i + 1))
+
+        bool load(const string &path)
         {
-            if (card[i] == 3) //有三带一/三带二 的可能性
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ActionTableHeader))
             {
-                triplet_num++;
-                value += i * 6; // value与牌面的值有关 如i=NINE时 value=36 i=TWO时 value=72
-                hand_num++;
+                close(fd);
+                return false;
             }
-            if (card[i] == 4)
-            {                        //如果有炸弹
-                value += i * 7 + 30; // i=NINE时 value=72 i=TWO value=114
-                hand_num++;
+            void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED)
+                return false;
+            const ActionTableHeader *h = (const ActionTableHeader *)mapped;
+            if (!valid(h, st.st_size))
+            {
+                munmap(mapped, st.st_size);
+                return false;
             }
+            data = mapped;
+            length = st.st_size;
+            header = h;
+            const char *base = (const char *)data;
+            shapes = (const ActionShape *)(base + h->shapes_offset);
+            first_segment = (const uint32_t *)(base + h->first_segment_offset);
+            segments = (const ActionSegment *)(base + h->segments_offset);
+            actions = (const EncodedCards *)(base + h->actions_offset);
+            starts = (const uint8_t *)(base + h->starts_offset);
+            for (uint32_t i = 1; i < h->shape_count; i++)
+                shape_ids[shapes[i].type][shapes[i].length][shapes[i].appendix] = i;
+            return true;
+        }
+
+        bool loaded() const
+        {
+            return data != NULL;
         }
-        for (CardType i = START_CARD; i <= TWO; i = CardType(i + 1))
+
+        // 查表得到hand压last时的全部动作，写入out；表中没有时返回false
+        bool lookup(EncodedCards hand, EncodedCards last, vector<EncodedCards> &out) const
         {
-            //扫描单个的和一对的 如果可以和三带凑一起就凑一起
-            if (card[i] == 1)
+            if (!data || !MINI_DECK || cardCount(hand) > (int)header->max_hand_cards)
+                return false;
+            int index = miniDeckIndex(hand);
+            const ActionSegment *begin = segments + first_segment[index], *end = segments + first_segment[index + 1];
+            out.clear();
+            if (last == NO_CARDS)
             {
-                if (triplet_num)
-                {
-                    triplet_num--;
-                }
-                else
-                {
-                    value += i * 2; // TWO 24
-                    hand_num++;
-                }
+                append(find(begin, end, LEAD_SHAPE), out);
+                return true;
             }
-            if (card[i] == 2)
+            Hand last_hand(last);
+            const ActionSegment *tail = find(begin, end, TAIL_SHAPE);
+            if (last_hand.isRocket())
             {
-                if (triplet_num)
-                {
-                    triplet_num--;
-                }
-                else
-                {
-                    value += i * 3; // TWO 36
-                    hand_num++;
-                }
+                out.push_back(NO_CARDS);
+                return true;
+            }
+            if (last_hand.isBomb())
+            {
+                out.push_back(NO_CARDS);
+                append(tail, out, last_hand.start);
+                return true;
             }
+            if (last_hand.length > MAX_CARD_TYPE_NUM || last_hand.appendix > 4)
+                return false;
+            int shape = shape_ids[last_hand.type][last_hand.length][last_hand.appendix];
+            if (shape < 0)
+                return false;
+            out.push_back(NO_CARDS);
+            append(find(begin, end, shape), out, last_hand.start);
+            append(tail, out);
+            return true;
         }
-        value -= hand_num * 10;
-        return value;
-    }
 
-    //如果我们是农民，那么p1card是农民的牌
-    //四个参数分别对应我们的牌，对手1的牌，对手2的牌，我们是不是地主
-    double evaluate_global_situation(vector<int> my_card,
-                                     vector<int> p1_card, vector<int> p2_card, int pos) //评估全局的当前局面的好坏
-    {
-        double global_value = 0;
-        if (pos == 0)
+    private:
+        // 检查文件头、各部分的范围和对齐，以及查表时用作下标的每个字段，
+        // 保证截断或损坏的文件不会在查表时越界读
+        static bool valid(const ActionTableHeader *h, uint64_t size)
         {
-            //如果我们是地主
-            global_value += evaluate_each_player(my_card) - 0.5 * (evaluate_each_player(p1_card) + (evaluate_each_player(p2_card)));
+            if (memcmp(h->magic, ACTION_TABLE_MAGIC, sizeof(h->magic)) != 0 || h->version != ACTION_TABLE_VERSION ||
+                h->start_card != START_CARD || h->hand_slots != MINI_DECK_HANDS)
+                return false;
+            // 形状编号存放在int8_t中，并且不能与TAIL_SHAPE重合
+            if (h->shape_count == 0 || h->shape_count > 128)
+                return false;
+            // 每一部分都在文件之内并且按元素大小对齐；元素数不超过2^32，乘积不会溢出
+            auto section = [size](uint64_t offset, uint64_t count, uint64_t element)
+            {
+                return offset <= size && count * element <= size - offset && offset % element == 0;
+            };
+            if (!section(h->shapes_offset, h->shape_count, sizeof(ActionShape)) ||
+                !section(h->first_segment_offset, uint64_t(h->hand_slots) + 1, sizeof(uint32_t)) ||
+                !section(h->segments_offset, h->segment_count, sizeof(ActionSegment)) ||
+                !section(h->actions_offset, h->action_count, sizeof(EncodedCards)) ||
+                !section(h->starts_offset, h->action_count, sizeof(uint8_t)))
+                return false;
+            const char *base = (const char *)h;
+            const ActionShape *shapes = (const ActionShape *)(base + h->shapes_offset);
+            for (uint32_t i = 1; i < h->shape_count; i++)
+                if (shapes[i].type > ROCKET || shapes[i].length > MAX_CARD_TYPE_NUM || shapes[i].appendix > 4)
+                    return false;
+            // 每手牌的段连续存放，段内的动作都在动作数组之内
+            const uint32_t *first_segment = (const uint32_t *)(base + h->first_segment_offset);
+            for (uint32_t i = 0; i < h->hand_slots; i++)
+                if (first_segment[i] > first_segment[i + 1])
+                    return false;
+            if (first_segment[h->hand_slots] > h->segment_count)
+                return false;
+            const ActionSegment *segments = (const ActionSegment *)(base + h->segments_offset);
+            for (uint32_t i = 0; i < h->segment_count; i++)
+                if (uint64_t(segments[i].begin) + segments[i].count > h->action_count)
+                    return false;
+            return true;
         }
-        else
+
+        void *data;
+        size_t length;
+        const ActionTableHeader *header;
+        const ActionShape *shapes;
+        const uint32_t *first_segment;
+        const ActionSegment *segments;
+        const EncodedCards *actions;
+        const uint8_t *starts;
+        // (主牌类型, 长度, 副牌) -> 形状编号，-1表示表中没有
+        int8_t shape_ids[ROCKET + 1][MAX_CARD_TYPE_NUM + 1][5];
+
+        static const ActionSegment *find(const ActionSegment *begin, const ActionSegment *end, int shape)
         {
-            global_value += 0.5 * (evaluate_each_player(my_card) + evaluate_each_player(p1_card)) - evaluate_each_player(p2_card);
+            for (; begin != end; begin++)
+                if (begin->shape == shape)
+                    return begin;
+            return NULL;
         }
-        return global_value;
-    }
 
-    //估计给定combo在特定手牌和上家的情况下被打出的概率
-    double getComboProbability(EncodedCards my_combo, doudizhu::DoudizhuState my_state)
-    {
-        //概率正比于打出去的牌的得分和余下手牌的得分
-        vector<EncodedCards> valid_actions = my_state.validActions(true);
-        //可以什么都不打，理论上应该排除地主第一轮不打牌，但应该没啥大问题
-        valid_actions.push_back(0);
-        EncodedCards encoded_my_cards = toEncodedCards(my_state.my_card_counter);
-        // printf("my combo: %llx\n", my_combo>>24);
-        //假设其他人按照正比于1/2^k的概率随机出牌，k是比my_combo分数高的出牌方案的个数
-        double flag = -1, combo_score;
-        int k = 0;
-        combo_score = evaluate_each_player(encodedCardsToCardCountVector(my_combo)) + evaluate_each_player(encodedCardsToCardCountVector(encoded_my_cards - my_combo));
-        for (EncodedCards combo : valid_actions)
+        // 追加一段中主牌起点大于after的动作（段内起点递增）
+        void append(const ActionSegment *segment, vector<EncodedCards> &out, int after = -1) const
         {
-            // printf("valid action: %llx\n", combo>>24);
-            if (combo == my_combo)
-            {
-                flag = 1;
-            }
-            else
-            {
-                double tmp = evaluate_each_player(encodedCardsToCardCountVector(combo)) + evaluate_each_player(encodedCardsToCardCountVector(encoded_my_cards - combo));
-                if (tmp >= combo_score)
-                    k++;
-            }
+            if (!segment)
+                return;
+            const uint8_t *first = starts + segment->begin, *last = first + segment->count;
+            const uint8_t *from = after < 0 ? first : upper_bound(first, last, uint8_t(after));
+            out.insert(out.end(), actions + (from - starts), actions + segment->begin + segment->count);
         }
-        if (flag == -1)
+    };
+
+    // 由--action-table加载；未加载时总是使用生成器
+    ActionTable action_table;
+
+    // 生成动作表文件：枚举迷你牌堆中不超过ACTION_TABLE_MAX_CARDS张的全部手牌，按ActionTable的格式写入path
+    bool buildActionTable(const string &path)
+    {
+        if (!MINI_DECK)
+            return false;
+        // 形状：整副牌自由出牌时所有不超过上限张数的非炸弹、非火箭牌型。把每种形状的一手牌的主牌起点
+        // 挪到START_CARD之前，压它的动作就是这种形状的全部动作
+        vector<ActionShape> shapes(1, ActionShape());
+        vector<Hand> shape_hands;
+        for (EncodedCards a : DoudizhuState(FULL_CARDS, NO_CARDS).validActions())
         {
-            cout << "Error in function getComboProbability! The input combo is not valid!\n";
-            return -1;
+            if (cardCount(a) > ACTION_TABLE_MAX_CARDS)
+                continue;
+            Hand hand(a);
+            if (hand.isRocket() || hand.isBomb())
+                continue;
+            ActionShape shape = {uint8_t(hand.type), uint8_t(hand.length), uint8_t(hand.appendix), 0};
+            bool seen = false;
+            for (const ActionShape &other : shapes)
+                seen |= other.type == shape.type && other.length == shape.length && other.appendix == shape.appendix;
+            if (seen)
+                continue;
+            hand.start = CardType(START_CARD - 1);
+            shapes.push_back(shape);
+            shape_hands.push_back(hand);
         }
-        else
-            return pow(0.95, k);
-    }
 
-    //给定未知的牌集合和已知的手牌，遍历所有可能的初始手牌，并记录在这个初始手牌情况下，history 记录的情况发生的条件概率
-    void transverseAllHands(CardType cur, vector<int> &known_cards_a, vector<int> &known_cards_b)
-    {
-        static double normalizor_factor = 0;
-        int cur_card_num_a = 0;
-        for (int i = 0; i < MAX_CARD_TYPE_NUM; i++)
-            cur_card_num_a += known_cards_a[i];
-        int max_card_num = 9 + 3 * (!player_a);
-        // printf("cur card %d, cur %d, max %d\n",cur, cur_card_num_a, max_card_num);
-        //搜索到端点后，记录在此条件下，出现history 中的局面的未归一化的概率，之后按照此概率随机
-        if (cur_card_num_a == max_card_num)
+        vector<uint32_t> first_segment(MINI_DECK_HANDS + 1);
+        vector<ActionSegment> segments;
+        vector<EncodedCards> actions;
+        vector<uint8_t> starts;
+        auto addSegment = [&](uint8_t shape, const vector<EncodedCards> &list, bool keep_starts)
+        {
+            if (list.empty())
+                return;
+            ActionSegment segment = {uint32_t(actions.size()), uint16_t(list.size()), shape, 0};
+            segments.push_back(segment);
+            for (EncodedCards a : list)
+            {
+                actions.push_back(a);
+                starts.push_back(keep_starts ? Hand(a).start : 0);
+            }
+        };
+        for (int index = 0; index < MINI_DECK_HANDS; index++)
         {
-            for (int i = START_CARD; i < MAX_CARD_TYPE_NUM; i++)
+            first_segment[index] = segments.size();
+            EncodedCards hand = NO_CARDS;
+            for (int i = START_CARD, rest = index; i <= JOKER; i++)
             {
-                known_cards_b[i] = full_cards[i] - known_cards_a[i] - my_initial_cards_counter[i];
+                hand = addToEncodedCards(CardType(i), hand, rest % (full_cards[i] + 1));
+                rest /= full_cards[i] + 1;
             }
-            // printf("transverse to %llx %llx unknown: %llx\n", (toEncodedCards(known_cards_a))>>24, (toEncodedCards(known_cards_b))>>24, (toEncodedCards(unknown_cards))>>24);
-            //  Duel!
-            //这两个变量维护当前轮数时二者的手牌
-            int pos = 3 - player_a - player_b;
-            EncodedCards cur_cards_a = toEncodedCards(known_cards_a), cur_cards_b = toEncodedCards(known_cards_b);
-            double conditional_probability = 1;
-            //假设另外两人每一轮出牌都是独立的，计算在给定二者手牌时，他们按照真实的出牌方式出牌的条件概率
-            for (int i = 0; i < turn; i++)
+            if (hand == NO_CARDS || cardCount(hand) > ACTION_TABLE_MAX_CARDS)
+                continue;
+            DoudizhuState state(hand, NO_CARDS);
+            vector<EncodedCards> tail = state.genBombs();
+            if (state.genRocket() != NO_CARDS)
+                tail.push_back(state.genRocket());
+            vector<EncodedCards> lead = state.validActions();
+            addSegment(LEAD_SHAPE, lead, false);
+            for (unsigned k = 1; k < shapes.size(); k++)
             {
-                // turn 是玩家进行的局数，如果另一个player 在玩家顺序后面，那么他时比玩家少经历一轮的
-                if (i != turn - 1 || player_a < pos)
-                {
-                    conditional_probability *= getComboProbability(history_combo[player_a][i], DoudizhuState(cur_cards_a, history_last_action[player_a][i]));
-                    cur_cards_a -= history_combo[player_a][i];
-                }
-                else if (i != turn - 1 || player_b < pos)
+                // 对每个可能的起点生成一次，去掉开头的pass和末尾的炸弹火箭后，起点越大的结果必须是起点小的结果的后缀。
+                // 每个动作记录的"起点"为它不再出现时的最小起点，查表时取记录值大于last起点的那些动作。
+                // （不直接解析动作的牌型：像四带两对中用炸弹当对子这样的动作，解析出的起点与生成器不一致）
+                DoudizhuState responder(hand, NO_CARDS);
+                responder.last_action = shape_hands[k - 1];
+                vector<EncodedCards> base;
+                vector<uint8_t> base_starts;
+                for (int start = START_CARD - 1; start <= JOKER; start++)
                 {
-                    conditional_probability *= getComboProbability(history_combo[player_b][i], DoudizhuState(cur_cards_b, history_last_action[player_b][i]));
-                    cur_cards_b -= history_combo[player_b][i];
+                    responder.last_action.start = CardType(start);
+                    vector<EncodedCards> response = responder.validActions();
+                    if (response.size() < tail.size() + 1 || response[0] != NO_CARDS ||
+                        !equal(tail.begin(), tail.end(), response.end() - tail.size()))
+                        return false;
+                    size_t main_count = response.size() - 1 - tail.size();
+                    if (start == START_CARD - 1)
+                    {
+                        base.assign(response.begin() + 1, response.begin() + 1 + main_count);
+                        base_starts.assign(main_count, JOKER + 1);
+                    }
+                    else if (main_count > base.size() || !equal(response.begin() + 1, response.begin() + 1 + main_count, base.end() - main_count))
+                        return false;
+                    for (size_t i = 0; i < base.size() - main_count; i++)
+                        base_starts[i] = min<int>(base_starts[i], start);
                 }
+                if (base.empty())
+                    continue;
+                ActionSegment segment = {uint32_t(actions.size()), uint16_t(base.size()), uint8_t(k), 0};
+                segments.push_back(segment);
+                actions.insert(actions.end(), base.begin(), base.end());
+                starts.insert(starts.end(), base_starts.begin(), base_starts.end());
             }
-            //计算在给定二者手牌时，他们按照真实的出牌方式出牌的条件概率的累计分布函数
-            normalizor_factor += conditional_probability;
-            cumulative_probability.push_back(normalizor_factor);
-            possible_hands_a.push_back(toEncodedCards(known_cards_a));
-            return;
+            // 炸弹和火箭按牌型比较大小，起点就是炸弹的牌种（火箭为Joker）
+            addSegment(TAIL_SHAPE, tail, true);
         }
-        if (cur > JOKER)
-            return;
-        for (int i = 0; i <= min(4 - known_cards_a[cur], unknown_cards[cur]); i++)
+        first_segment[MINI_DECK_HANDS] = segments.size();
+
+        ActionTableHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, ACTION_TABLE_MAGIC, sizeof(header.magic));
+        header.version = ACTION_TABLE_VERSION;
+        header.start_card = START_CARD;
+        header.max_hand_cards = ACTION_TABLE_MAX_CARDS;
+        header.hand_slots = MINI_DECK_HANDS;
+        header.shape_count = shapes.size();
+        header.segment_count = segments.size();
+        header.action_count = actions.size();
+        // 各部分按8字节对齐依次存放
+        auto align = [](uint64_t offset) { return (offset + 7) & ~7ull; };
+        header.shapes_offset = sizeof(header);
+        header.first_segment_offset = align(header.shapes_offset + shapes.size() * sizeof(ActionShape));
+        header.segments_offset = align(header.first_segment_offset + first_segment.size() * sizeof(uint32_t));
+        header.actions_offset = align(header.segments_offset + segments.size() * sizeof(ActionSegment));
+        header.starts_offset = align(header.actions_offset + actions.size() * sizeof(EncodedCards));
+
+        FILE *file = fopen(path.c_str(), "wb");
+        if (!file)
+            return false;
+        auto writeAt = [file](uint64_t offset, const void *p, size_t bytes)
         {
-            if (cur_card_num_a + i > max_card_num)
-                break;
-            known_cards_a[cur] += i;
-            transverseAllHands(CardType(cur + 1), known_cards_a, known_cards_b);
-            known_cards_a[cur] -= i;
-        }
+            static const char zeros[8] = {};
+            fwrite(zeros, 1, offset - ftell(file), file);
+            fwrite(p, 1, bytes, file);
+        };
+        writeAt(0, &header, sizeof(header));
+        writeAt(header.shapes_offset, shapes.data(), shapes.size() * sizeof(ActionShape));
+        writeAt(header.first_segment_offset, first_segment.data(), first_segment.size() * sizeof(uint32_t));
+        writeAt(header.segments_offset, segments.data(), segments.size() * sizeof(ActionSegment));
+        writeAt(header.actions_offset, actions.data(), actions.size() * sizeof(EncodedCards));
+        writeAt(header.starts_offset, starts.data(), starts.size());
+        return fclose(file) == 0;
     }
 
-    //从已经计算出的后验分布中采样,输出一个vector分别是自己的下家的当前手牌，自己的上家的当前手牌, 自己的当前手牌
-    vector<EncodedCards> sample()
+    // validActions的LRU缓存，每个线程一份，容量为缓存的动作列表个数，0表示不使用缓存
+    size_t action_cache_capacity = 1 << 14;
+    // 所有线程的缓存命中、查询次数
+    atomic<long long> action_cache_hits(0), action_cache_lookups(0);
+
+    // 以(手牌, 上一手牌, 是否生成副牌)为键缓存validActions的结果
+    class ActionCache
     {
-        double random_number = (rand() % 100000000) / (double)100000000;
-        int l = 0, r = possible_hands_a.size() - 1;
-        while (l < r)
+    public:
+        // 返回的引用在本线程下一次调用get之前有效
+        const vector<EncodedCards> &get(EncodedCards hand, EncodedCards last, bool generate_appendix)
         {
-            int mid = (l + r) / 2;
-            if (cumulative_probability[mid] < random_number)
-                l = mid + 1;
+            action_cache_lookups.fetch_add(1, memory_order_relaxed);
+            Key key = {hand, last, generate_appendix};
+            auto found = index.find(key);
+            if (found != index.end())
+            {
+                action_cache_hits.fetch_add(1, memory_order_relaxed);
+                entries.splice(entries.begin(), entries, found->second);
+                return found->second->second;
+            }
+            if (action_cache_capacity == 0)
+            {
+                generate(hand, last, generate_appendix, uncached);
+                return uncached;
+            }
+            // 满了就把最久未用的条目挪到表头重新使用
+            if (entries.size() >= action_cache_capacity)
+            {
+                index.erase(entries.back().first);
+                entries.splice(entries.begin(), entries, prev(entries.end()));
+                entries.front().first = key;
+            }
             else
-                r = mid;
+                entries.push_front(make_pair(key, vector<EncodedCards>()));
+            generate(hand, last, generate_appendix, entries.front().second);
+            index[key] = entries.begin();
+            return entries.front().second;
         }
-        vector<EncodedCards> ans;
-        ans.push_back(possible_hands_a[l] - cards_played_a);
-        ans.push_back(FULL_CARDS - possible_hands_a[l] - encoded_my_initial_cards - cards_played_b);
-        ans.push_back(encoded_my_initial_cards - cards_played_c);
-        return ans;
+
+    private:
+        // 未命中时先查动作表，表中没有的再调用生成器
+        static void generate(EncodedCards hand, EncodedCards last, bool generate_appendix, vector<EncodedCards> &out)
+        {
+            if (!generate_appendix || !action_table.lookup(hand, last, out))
+                out = DoudizhuState(hand, last).validActions(generate_appendix);
+        }
+
+        struct Key
+        {
+            EncodedCards hand, last;
+            bool generate_appendix;
+            bool operator==(const Key &other) const
+            {
+                return hand == other.hand && last == other.last && generate_appendix == other.generate_appendix;
+            }
+        };
+        struct KeyHash
+        {
+            size_t operator()(const Key &key) const
+            {
+                return (key.hand * 0x9e3779b97f4a7c15ull) ^ (key.last * 0xc2b2ae3d27d4eb4full) ^ key.generate_appendix;
+            }
+        };
+        // 表头是最近使用的条目
+        list<pair<Key, vector<EncodedCards> > > entries;
+        unordered_map<Key, list<pair<Key, vector<EncodedCards> > >::iterator, KeyHash> index;
+        vector<EncodedCards> uncached;
+    };
+
+    // 带缓存的validActions，结果与DoudizhuState(hand, last).validActions(generate_appendix)相同。
+    // 返回的引用在本线程下一次调用之前有效
+    const vector<EncodedCards> &cachedValidActions(EncodedCards hand, EncodedCards last, bool generate_appendix = true)
+    {
+        static thread_local ActionCache cache;
+        return cache.get(hand, last, generate_appendix);
     }
 
-    /** play a card from previous hand */
-    EncodedCards playCard (EncodedCards prev, EncodedCards combo)
+    // 最少出牌手数表：下标为手牌的完美散列编号，表项存放手数+1，0表示尚未计算。
+    // 表项在第一次查询时由DP递归求出，之后O(1)查表。多个线程同时计算同一项时结果相同，
+    // 因此只需原子地读写单个表项。整副牌（非迷你牌堆）时改用每个线程各自的散列表记忆
+    atomic<uint8_t> min_hands_table[MINI_DECK ? MINI_DECK_HANDS : 1];
+
+    // 不考虑对手时，把hand出完最少需要几手
+    int minHands(EncodedCards hand)
     {
-        for (int i = 0; i < MAX_CARD_TYPE_NUM; i++)
-            prev = minusFromEncodedCards((CardType)i, prev, numCardOfEncoded((CardType)i, combo)); 
-        return prev;
+        if (hand == NO_CARDS)
+            return 0;
+        static thread_local unordered_map<EncodedCards, int> full_deck_memo;
+        if (!MINI_DECK)
+        {
+            auto found = full_deck_memo.find(hand);
+            if (found != full_deck_memo.end())
+                return found->second;
+        }
+        else
+        {
+            int cached = min_hands_table[miniDeckIndex(hand)].load(memory_order_relaxed);
+            if (cached)
+                return cached - 1;
+        }
+        // 任何一种拆法中都有一手包含最小的那种牌，只需枚举这些动作
+        CardType lowest = START_CARD;
+        while (!numCardOfEncoded(lowest, hand))
+            lowest = CardType(lowest + 1);
+        int best = MAX_CARD_NUM;
+        for (EncodedCards action : DoudizhuState(hand, NO_CARDS).validActions())
+        {
+            if (numCardOfEncoded(lowest, action))
+                best = min(best, 1 + minHands(hand - action));
+        }
+        if (MINI_DECK)
+            min_hands_table[miniDeckIndex(hand)].store(uint8_t(best + 1), memory_order_relaxed);
+        else
+            full_deck_memo[hand] = best;
+        return best;
     }
 
-    class MCTNode {
-    public:
-        MCTNode *parent;
-        EncodedCards last_action;
-        vector<pair<EncodedCards, MCTNode*> > childs; 
-        double score;
-        int curPlayer, dep, nEval;
-        bool finishNode;
-        MCTNode(EncodedCards _last_action, MCTNode * _parent = NULL, int _dep = 0):curPlayer(2), dep(_dep), nEval(0), score(0),
-                            finishNode(false), parent(_parent)
+    // 一种手数最少的拆法，按出牌顺序给出每一手
+    vector<EncodedCards> minHandsDecomposition(EncodedCards hand)
+    {
+        vector<EncodedCards> plays;
+        while (hand != NO_CARDS)
+        {
+            int target = minHands(hand) - 1;
+            for (EncodedCards action : DoudizhuState(hand, NO_CARDS).validActions())
+            {
+                if (minHands(hand - action) == target)
+                {
+                    plays.push_back(action);
+                    hand -= action;
+                    break;
+                }
+            }
+        }
+        return plays;
+    }
+
+    // 评估一个玩家的手牌：按最少出牌手数计分，手数越多离出完越远。
+    // card是该玩家手里的牌
+    double evaluate_each_player(EncodedCards card)
+    {
+        return minHands(card) * 10;
+    }
+
+    //如果我们是农民，那么p1card是农民的牌
+    //四个参数分别对应我们的牌，对手1的牌，对手2的牌，我们是不是地主
+    double evaluate_global_situation(EncodedCards my_card,
+                                     EncodedCards p1_card, EncodedCards p2_card, int pos) //评估全局的当前局面的好坏
+    {
+        double global_value = 0;
+        if (pos == 0)
+        {
+            //如果我们是地主
+            global_value += evaluate_each_player(my_card) - 0.5 * (evaluate_each_player(p1_card) + (evaluate_each_player(p2_card)));
+        }
+        else
+        {
+            global_value += 0.5 * (evaluate_each_player(my_card) + evaluate_each_player(p1_card)) - evaluate_each_player(p2_card);
+        }
+        return global_value;
+    }
+
+    // 可选的学习估值模型，用于替代evaluate_global_situation。
+    // 输入特征：当前玩家、下家、上家的手牌以及待压的牌，各15种牌的数目，再加当前玩家身份的one-hot，共VALUE_FEATURES维；
+    // 网络为单隐层ReLU（hidden为0时退化为线性模型），输出scale*tanh(z)，与启发式估值处于同一量级。
+    // 第一层权重在加载时按行量化为int8，输入都是0-4的小整数，因此隐层的点积完全是整数运算
+    const int VALUE_FEATURES = 64;
+
+    void valueFeatures(EncodedCards mine, EncodedCards next, EncodedCards prev, EncodedCards last, int pos, int8_t *x)
+    {
+        EncodedCards groups[4] = {mine, next, prev, last};
+        for (int g = 0; g < 4; g++)
+            for (int i = 0; i < MAX_CARD_TYPE_NUM; i++)
+                x[g * MAX_CARD_TYPE_NUM + i] = int8_t((groups[g] >> (i << 2)) & 0xf);
+        for (int i = 4 * MAX_CARD_TYPE_NUM; i < VALUE_FEATURES; i++)
+            x[i] = 0;
+        x[4 * MAX_CARD_TYPE_NUM + pos] = 1;
+    }
+
+    struct ValueModel
+    {
+        int hidden;
+        double scale;
+        // hidden x VALUE_FEATURES的int8权重，以及每行的反量化系数
+        vector<int8_t> w1;
+        vector<float> w1_scale, b1;
+        // 输出层权重：hidden维；线性模型时为VALUE_FEATURES维
+        vector<float> w2;
+        float b2;
+
+        ValueModel() : hidden(0), scale(0), b2(0) {}
+
+        bool loaded() const
+        {
+            return !w2.empty();
+        }
+
+        // 文件格式（空白分隔的文本）：
+        //   value-model <hidden> <scale>
+        //   w1: hidden行，每行VALUE_FEATURES个浮点数（hidden为0时没有）
+        //   b1: hidden个浮点数
+        //   w2: hidden个浮点数（hidden为0时为VALUE_FEATURES个）
+        //   b2
+        bool load(const string &path)
+        {
+            ifstream in(path.c_str());
+            string magic;
+            if (!(in >> magic >> hidden >> scale) || magic != "value-model" || hidden < 0)
+                return false;
+            vector<float> w(hidden * VALUE_FEATURES);
+            b1.assign(hidden, 0);
+            w2.assign(hidden ? hidden : VALUE_FEATURES, 0);
+            for (float &v : w)
+                in >> v;
+            for (float &v : b1)
+                in >> v;
+            for (float &v : w2)
+                in >> v;
+            in >> b2;
+            if (!in)
+            {
+                w2.clear();
+                return false;
+            }
+            w1.assign(w.size(), 0);
+            w1_scale.assign(hidden, 0);
+            for (int j = 0; j < hidden; j++)
+            {
+                float max_abs = 0;
+                for (int i = 0; i < VALUE_FEATURES; i++)
+                    max_abs = max(max_abs, fabs(w[j * VALUE_FEATURES + i]));
+                w1_scale[j] = max_abs > 0 ? max_abs / 127 : 1;
+                for (int i = 0; i < VALUE_FEATURES; i++)
+                    w1[j * VALUE_FEATURES + i] = int8_t(lround(w[j * VALUE_FEATURES + i] / w1_scale[j]));
+            }
+            return true;
+        }
+
+        double evaluate(const int8_t *x) const
         {
-            if (isPass(_last_action) && _parent != NULL)
-                if (!isPass(_parent->last_action))
-                    _last_action = _parent->last_action;
-            last_action = _last_action;
+            float z = b2;
+            if (hidden == 0)
+            {
+                for (int i = 0; i < VALUE_FEATURES; i++)
+                    z += w2[i] * x[i];
+            }
+            for (int j = 0; j < hidden; j++)
+            {
+                const int8_t *w = &w1[j * VALUE_FEATURES];
+                int acc = 0;
+                for (int i = 0; i < VALUE_FEATURES; i++)
+                    acc += w[i] * x[i];
+                float h = acc * w1_scale[j] + b1[j];
+                if (h > 0)
+                    z += w2[j] * h;
+            }
+            return scale * tanh(z);
         }
-        
     };
 
-    double UCT (MCTNode * p, MCTNode * v)
+    // 由--value-model加载；未加载时使用启发式估值
+    ValueModel value_model;
+
+    //估计给定combo在特定手牌和上家的情况下被打出的概率
+    double getComboProbability(EncodedCards my_combo, EncodedCards encoded_my_cards, EncodedCards last_action)
     {
-        return v->score / (double) v->nEval + sqrt(log((double) p->nEval)/(double) v->nEval);
+        //概率正比于打出去的牌的得分和余下手牌的得分
+        // printf("my combo: %llx\n", my_combo>>24);
+        //假设其他人按照正比于0.95^k的概率随机出牌，k是不比my_combo差的其他出牌方案的个数。
+        //得分是出完这手牌和剩下的牌各需的手数，越小越好
+        //能否打出由裁判直接判断；pass总是计入（理论上应该排除地主第一轮不打牌，但应该没啥大问题）
+        if (my_combo != NO_CARDS && !isLegalPlay(encoded_my_cards, my_combo, last_action))
+        {
+            cerr << "Error in function getComboProbability! The input combo is not valid!\n";
+            return -1;
+        }
+        const vector<EncodedCards> &valid_actions = cachedValidActions(encoded_my_cards, last_action, true);
+        double combo_score;
+        int k = 0;
+        combo_score = evaluate_each_player(my_combo) + evaluate_each_player(encoded_my_cards - my_combo);
+        //（下标为valid_actions.size()时表示pass）
+        for (size_t i = 0; i <= valid_actions.size(); i++)
+        {
+            EncodedCards combo = i < valid_actions.size() ? valid_actions[i] : NO_CARDS;
+            // printf("valid action: %llx\n", combo>>24);
+            if (combo != my_combo)
+            {
+                double tmp = evaluate_each_player(combo) + evaluate_each_player(encoded_my_cards - combo);
+                if (tmp <= combo_score)
+                    k++;
+            }
+        }
+        return pow(0.95, k);
     }
 
-    pair<EncodedCards, MCTNode*> bestChild (MCTNode * v)
+    // 后验剪枝的界：posterior_epsilon > 0 时，似然不到已知最大似然posterior_epsilon倍的手牌直接放弃；
+    // posterior_top_k > 0 时只保留似然最大的posterior_top_k种手牌。默认都不剪枝，后验是精确的
+    double posterior_epsilon = 0;
+    int posterior_top_k = 0;
+
+    // 后验分布枚举的结果缓冲：可能的初始手牌及其未归一化的概率
+    struct PosteriorBuffer
+    {
+        vector<EncodedCards> hands;
+        vector<double> weights;
+        // 本缓冲中似然最大的posterior_top_k个值（小根堆），堆顶即为top-K剪枝的界
+        priority_queue<double, vector<double>, greater<double> > top;
+        int enumerated = 0;
+    };
+
+    // 给定a的初始手牌，计算history中的出牌记录出现的条件概率（未归一化）。
+    // 每一项概率都不超过1，所以连乘的中间结果是最终结果的上界：一旦低于bound就提前返回该中间结果
+    double handLikelihood(const GameContext &ctx, const CardCounter &known_cards_a, double bound = 0)
     {
-        pair<EncodedCards, MCTNode*> bestPair = v->childs[0];
-        double score = UCT (v, bestPair.second);
-        for (auto p: v->childs)        
-            if (UCT(v, p.second) > score)
+        CardCounter known_cards_b = {};
+        for (int i = START_CARD; i < MAX_CARD_TYPE_NUM; i++)
+        {
+            known_cards_b[i] = full_cards[i] - known_cards_a[i] - ctx.my_initial_cards_counter[i];
+        }
+        // printf("transverse to %llx %llx unknown: %llx\n", (toEncodedCards(known_cards_a))>>24, (toEncodedCards(known_cards_b))>>24, (toEncodedCards(ctx.unknown_cards))>>24);
+        //  Duel!
+        //这两个变量维护当前轮数时二者的手牌
+        int pos = 3 - ctx.player_a - ctx.player_b;
+        EncodedCards cur_cards_a = toEncodedCards(known_cards_a), cur_cards_b = toEncodedCards(known_cards_b);
+        double conditional_probability = 1;
+        //假设另外两人每一轮出牌都是独立的，计算在给定二者手牌时，他们按照真实的出牌方式出牌的条件概率
+        for (int i = 0; i < ctx.turn; i++)
+        {
+            // turn 是玩家进行的局数，如果另一个player 在玩家顺序后面，那么他时比玩家少经历一轮的
+            if (i != ctx.turn - 1 || ctx.player_a < pos)
+            {
+                conditional_probability *= max(0.0, getComboProbability(ctx.history_combo[ctx.player_a][i], cur_cards_a, ctx.history_last_action[ctx.player_a][i]));
+                cur_cards_a -= ctx.history_combo[ctx.player_a][i];
+            }
+            else if (i != ctx.turn - 1 || ctx.player_b < pos)
             {
-                bestPair = p;
-                score = UCT(v, p.second);
+                conditional_probability *= max(0.0, getComboProbability(ctx.history_combo[ctx.player_b][i], cur_cards_b, ctx.history_last_action[ctx.player_b][i]));
+                cur_cards_b -= ctx.history_combo[ctx.player_b][i];
             }
-        return bestPair;
+            // 打不出记录中的牌（getComboProbability返回-1）时似然为0
+            if (conditional_probability <= 0 || conditional_probability < bound)
+                break;
+        }
+        return conditional_probability;
     }
 
-    MCTNode* expand (MCTNode * v, vector<EncodedCards> & prev_state)
+    //给定未知的牌集合和已知的手牌，从第cur种牌开始遍历所有可能的初始手牌，并记录在这个初始手牌情况下，history 记录的情况发生的条件概率
+    void transverseAllHands(GameContext &ctx, CardType cur, CardCounter &known_cards_a, PosteriorBuffer &out)
     {
-        MCTNode * p;
-        vector<int> vec;
-        for (int i = 0; i < v->childs.size(); i++)
-            vec.push_back(i);
-        random_shuffle (vec.begin(), vec.end());
-        for (int i = 0; i < v->childs.size(); i++)
-            if (v->childs[vec[i]].second == NULL)
+        int cur_card_num_a = 0;
+        for (int i = 0; i < MAX_CARD_TYPE_NUM; i++)
+            cur_card_num_a += known_cards_a[i];
+        int max_card_num = 9 + 3 * (!ctx.player_a);
+        // printf("cur card %d, cur %d, max %d\n",cur, cur_card_num_a, max_card_num);
+        //搜索到端点后，记录在此条件下，出现history 中的局面的未归一化的概率，之后按照此概率随机
+        if (cur_card_num_a == max_card_num)
+        {
+            out.enumerated++;
+            // 似然已经低于界的手牌不会出现在最终的后验分布中，不必算完
+            double bound = posterior_epsilon * ctx.posterior_best_weight.load();
+            if (posterior_top_k > 0 && out.top.size() == (size_t)posterior_top_k)
+                bound = max(bound, out.top.top());
+            double weight = handLikelihood(ctx, known_cards_a, bound);
+            if (weight < bound)
+                return;
+            out.weights.push_back(weight);
+            out.hands.push_back(toEncodedCards(known_cards_a));
+            double best = ctx.posterior_best_weight.load();
+            while (weight > best && !ctx.posterior_best_weight.compare_exchange_weak(best, weight))
+                ;
+            if (posterior_top_k > 0)
             {
-                EncodedCards last_action = v->childs[vec[i]].first;
-                p = v->childs[vec[i]].second = new MCTNode (last_action, v, v->dep+1);
-                p->curPlayer = (v->curPlayer + 1)%3;
-                prev_state[v->curPlayer] = playCard (prev_state[v->curPlayer], last_action);
-                if (isFinished (prev_state))
-                    p->finishNode = true;
-                else
-                {
-                    for(EncodedCards action: DoudizhuState(prev_state[p->curPlayer], p->last_action).validActions())
-                        p->childs.push_back(make_pair(action, (MCTNode*) NULL));
-                }
-                return p;
+                out.top.push(weight);
+                if (out.top.size() > (size_t)posterior_top_k)
+                    out.top.pop();
             }
-        return NULL;
+            return;
+        }
+        // 剩下的牌全拿也凑不满手牌数
+        if (cur > JOKER || cur_card_num_a + ctx.posterior_capacity[cur] < max_card_num)
+            return;
+        for (int i = 0; i <= min(4 - known_cards_a[cur], ctx.unknown_cards[cur]); i++)
+        {
+            if (cur_card_num_a + i > max_card_num)
+                break;
+            known_cards_a[cur] += i;
+            transverseAllHands(ctx, CardType(cur + 1), known_cards_a, out);
+            known_cards_a[cur] -= i;
+        }
+    }
+
+    // 枚举时按前几种牌的数目把搜索树切分为互相独立的子任务
+    const int POSTERIOR_SPLIT_DEPTH = 3;
+
+    // 后验分布枚举的一个子任务：known_cards_a中cur之前的牌已经确定
+    struct PosteriorTask
+    {
+        CardType cur;
+        CardCounter known_cards_a;
     };
-    
-    MCTNode* TreePolicy (MCTNode * v, vector<EncodedCards> & init_state)
+
+    // 与transverseAllHands的遍历顺序相同，把前depth种牌的所有取法生成子任务
+    void splitPosteriorTasks(const GameContext &ctx, CardType cur, int depth, CardCounter &known_cards_a, vector<PosteriorTask> &tasks)
     {
-        while (!v->finishNode)
+        int cur_card_num_a = 0;
+        for (int i = 0; i < MAX_CARD_TYPE_NUM; i++)
+            cur_card_num_a += known_cards_a[i];
+        int max_card_num = 9 + 3 * (!ctx.player_a);
+        if (cur <= JOKER && cur_card_num_a < max_card_num && cur_card_num_a + ctx.posterior_capacity[cur] < max_card_num)
+            return;
+        if (depth == 0 || cur_card_num_a == max_card_num || cur > JOKER)
         {
-            // v is not fully expanded
-            if(v->nEval < v->childs.size() + 1)
-                return expand(v, init_state);
-            auto best_child = bestChild (v);
-            init_state[v->curPlayer] = playCard(init_state[v->curPlayer], best_child.first);
-            v = best_child.second;
+            PosteriorTask task;
+            task.cur = cur;
+            task.known_cards_a = known_cards_a;
+            tasks.push_back(task);
+            return;
+        }
+        for (int i = 0; i <= min(4 - known_cards_a[cur], ctx.unknown_cards[cur]); i++)
+        {
+            if (cur_card_num_a + i > max_card_num)
+                break;
+            known_cards_a[cur] += i;
+            splitPosteriorTasks(ctx, CardType(cur + 1), depth - 1, known_cards_a, tasks);
+            known_cards_a[cur] -= i;
         }
-        return v;
     }
-    
-    double defaultPolicy (MCTNode * s, vector<EncodedCards> & curState, int myPos)
+
+    // 初始化枚举所需的剪枝信息，并切分出枚举子任务
+    void preparePosterior(GameContext &ctx, CardCounter known_cards_a, vector<PosteriorTask> &tasks)
     {
-        int actualPos = (s->curPlayer+1+myPos)%3;
-        vector<int> myCard = encodedCardsToCardCountVector (curState[s->curPlayer]),
-                    nextCard = encodedCardsToCardCountVector (curState[(s->curPlayer+1)%3]), 
-                    prevCard = encodedCardsToCardCountVector (curState[(s->curPlayer+2)%3]);
-        switch (actualPos)
+        ctx.posterior_best_weight = 0;
+        ctx.posterior_capacity[MAX_CARD_TYPE_NUM] = 0;
+        for (int i = MAX_CARD_TYPE_NUM - 1; i >= 0; i--)
+            ctx.posterior_capacity[i] = ctx.posterior_capacity[i + 1] + (i < START_CARD ? 0 : min(4 - known_cards_a[i], ctx.unknown_cards[i]));
+        splitPosteriorTasks(ctx, START_CARD, POSTERIOR_SPLIT_DEPTH, known_cards_a, tasks);
+    }
+
+    // 按遍历顺序合并各子任务的结果，过滤后归一化
+    void finishPosterior(GameContext &ctx, const vector<PosteriorBuffer> &buffers)
+    {
+        double threshold = posterior_epsilon * ctx.posterior_best_weight.load();
+        // top-K：第K大的似然，以及恰好等于它的手牌还能保留几个
+        bool truncate = false;
+        double kth = 0;
+        int kth_quota = 0;
+        ctx.posterior_enumerated = 0;
+        vector<double> all_weights;
+        for (const PosteriorBuffer &buffer : buffers)
         {
-            case 0:
-            case 1:
-                return evaluate_global_situation (myCard, nextCard, prevCard, actualPos);
-            case 2:
-                return evaluate_global_situation (myCard, prevCard, nextCard, actualPos);
+            ctx.posterior_enumerated += buffer.enumerated;
+            if (posterior_top_k > 0)
+                all_weights.insert(all_weights.end(), buffer.weights.begin(), buffer.weights.end());
         }
-        return 0;
+        if (posterior_top_k > 0 && all_weights.size() > (size_t)posterior_top_k)
+        {
+            nth_element(all_weights.begin(), all_weights.begin() + posterior_top_k - 1, all_weights.end(), greater<double>());
+            truncate = true;
+            kth = all_weights[posterior_top_k - 1];
+            kth_quota = posterior_top_k - count_if(all_weights.begin(), all_weights.end(), [kth](double w) { return w > kth; });
+        }
+
+        ctx.possible_hands_a.clear();
+        ctx.cumulative_probability.clear();
+        //计算在给定二者手牌时，他们按照真实的出牌方式出牌的条件概率的累计分布函数
+        double normalizor_factor = 0;
+        for (const PosteriorBuffer &buffer : buffers)
+            for (size_t i = 0; i < buffer.hands.size(); i++)
+            {
+                double w = buffer.weights[i];
+                if (w <= 0 || w < threshold)
+                    continue;
+                if (truncate && (w < kth || (w == kth && kth_quota-- <= 0)))
+                    continue;
+                normalizor_factor += w;
+                ctx.cumulative_probability.push_back(normalizor_factor);
+                ctx.possible_hands_a.push_back(buffer.hands[i]);
+            }
+        // 对局记录与所有手牌都矛盾（似然全为0）时，退回到所有手牌等概率
+        if (ctx.possible_hands_a.empty())
+            for (const PosteriorBuffer &buffer : buffers)
+                for (EncodedCards hand : buffer.hands)
+                {
+                    normalizor_factor += 1;
+                    ctx.cumulative_probability.push_back(normalizor_factor);
+                    ctx.possible_hands_a.push_back(hand);
+                }
+        for (double &c : ctx.cumulative_probability)
+            c /= normalizor_factor;
+        ctx.posterior_mass = normalizor_factor;
+        ctx.posterior_kept = ctx.possible_hands_a.size();
     }
-    
-    void backUp (MCTNode *p, double delta, int myPos)
+
+    // 在线程池上并行枚举所有可能的初始手牌，合并各子任务的结果并归一化，
+    // 得到ctx中的possible_hands_a和cumulative_probability。子任务按遍历顺序合并，
+    // 合并时再按全局的最大似然和第K大似然过滤一遍，因此结果与线程数和剪枝的先后无关
+    void buildPosterior(GameContext &ctx, CardCounter known_cards_a)
     {
-        int originalPos = (p->curPlayer+1+myPos)%3, nowPos;
-        nowPos = originalPos;
-        while (p != NULL)
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        vector<PosteriorTask> tasks;
+        preparePosterior(ctx, known_cards_a, tasks);
+        vector<PosteriorBuffer> buffers(tasks.size());
+        threadPool().parallelFor(tasks.size(), [&](int t, int)
         {
-            p->nEval ++;
-            p->score += delta * (originalPos && nowPos ? 1.0 : -1.0);
-            p = p->parent;
-            nowPos = (nowPos + 2)%3;
-        }
+            transverseAllHands(ctx, tasks[t].cur, tasks[t].known_cards_a, buffers[t]);
+        });
+        finishPosterior(ctx, buffers);
+        ctx.posterior_build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+
+    // 本次决策使用的随机种子，所有随机数流都由它派生，相同的输入和种子可以完全复现一次决策
+    unsigned long long search_seed = 0;
+
+    // splitmix64：用于把种子展开成生成器状态，以及由(种子, 流编号)派生子流种子
+    inline unsigned long long splitmix64(unsigned long long &x)
+    {
+        unsigned long long z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
     }
 
-    void deleteMCT (MCTNode *p)
+    // 可拆分的随机数生成器（xoshiro256**）。每个线程、每个采样各自使用由同一种子派生的独立流，
+    // 派生结果只取决于种子和流编号，与线程调度无关
+    struct Rng
     {
-        queue<MCTNode*> q;
-        q.push(p);
-        while(!q.empty())
+        typedef unsigned long long result_type;
+        result_type state[4];
+        // 构造该生成器所用的种子，stream()据此派生子流
+        result_type origin;
+
+        explicit Rng(result_type seed = 0)
+        {
+            reseed(seed);
+        }
+
+        void reseed(result_type seed)
+        {
+            origin = seed;
+            for (int i = 0; i < 4; i++)
+                state[i] = splitmix64(seed);
+        }
+
+        // 第id条子流
+        Rng stream(result_type id) const
+        {
+            result_type x = origin ^ (id * 0xd1b54a32d192ed03ull);
+            return Rng(splitmix64(x));
+        }
+
+        static inline result_type rotl(result_type x, int k)
+        {
+            return (x << k) | (x >> (64 - k));
+        }
+
+        result_type next()
+        {
+            result_type result = rotl(state[1] * 5, 7) * 9;
+            result_type t = state[1] << 17;
+            state[2] ^= state[0];
+            state[3] ^= state[1];
+            state[1] ^= state[2];
+            state[0] ^= state[3];
+            state[2] ^= t;
+            state[3] = rotl(state[3], 45);
+            return result;
+        }
+
+        // [0, 1)上的均匀实数，取高53位
+        double nextDouble()
+        {
+            return (next() >> 11) * (1.0 / 9007199254740992.0);
+        }
+
+        // [0, n)上的无偏均匀整数（Lemire乘法拒绝法）
+        unsigned nextBounded(unsigned n)
+        {
+            unsigned long long m = (unsigned long long)(unsigned)(next() >> 32) * n;
+            unsigned low = (unsigned)m;
+            if (low < n)
+            {
+                unsigned threshold = -n % n;
+                while (low < threshold)
+                {
+                    m = (unsigned long long)(unsigned)(next() >> 32) * n;
+                    low = (unsigned)m;
+                }
+            }
+            return m >> 32;
+        }
+
+        // Fisher-Yates洗牌。不使用std::shuffle，保证不同标准库下结果一致
+        template <class RandomIt>
+        void shuffle(RandomIt first, RandomIt last)
         {
-            p = q.front(); q.pop();
-            for (auto child_pair: p->childs)
-                if(child_pair.second != NULL)
-                    q.push(child_pair.second);
-            delete(p);
+            for (unsigned i = last - first; i > 1; i--)
+                swap(first[i - 1], first[nextBounded(i)]);
         }
+
+        result_type operator()() { return next(); }
+        static result_type min() { return 0; }
+        static result_type max() { return ~0ull; }
+    };
+
+    //从已经计算出的后验分布中采样,输出一个vector分别是自己的下家的当前手牌，自己的上家的当前手牌, 自己的当前手牌
+    // 下家的初始手牌为hand_a时，三家当前的手牌
+    PlayerHands currentHands(const GameContext &ctx, EncodedCards hand_a)
+    {
+        PlayerHands ans = {{hand_a - ctx.cards_played_a,
+                            FULL_CARDS - hand_a - ctx.encoded_my_initial_cards - ctx.cards_played_b,
+                            ctx.encoded_my_initial_cards - ctx.cards_played_c}};
+        return ans;
     }
 
-    pair<EncodedCards, double> UCTSearch (const vector<EncodedCards> & init_state, EncodedCards lastAction, int myPos)
+    // hands和cdf给出下家初始手牌的分布，可以是尚未完成的部分后验
+    PlayerHands sample(const GameContext &ctx, const vector<EncodedCards> &hands, const vector<double> &cdf, Rng &rng)
     {
-        MCTNode *root = new MCTNode (lastAction), *ptr;
-        double delta;
-        root->curPlayer = 2; // Due to the sampling
-        root->nEval = 1;
-        for(EncodedCards action: DoudizhuState(init_state[root->curPlayer], lastAction).validActions())
-            root->childs.push_back(make_pair(action, (MCTNode*) NULL));
-        for (int i = 0; i < 100; i ++)
+        double random_number = rng.nextDouble();
+        int l = 0, r = hands.size() - 1;
+        while (l < r)
         {
-            vector<EncodedCards> curState = init_state;
-            ptr = TreePolicy (root, curState);   
-            delta = defaultPolicy (ptr, curState, myPos); 
-            backUp (ptr, delta, myPos);
+            int mid = (l + r) / 2;
+            if (cdf[mid] < random_number)
+                l = mid + 1;
+            else
+                r = mid;
         }
-        auto ret = bestChild(root);
-        delta = UCT(root, ret.second);
-        deleteMCT(root);
-        return make_pair(ret.first, delta);
+        return currentHands(ctx, hands[l]);
     }
 
-    bool compare (const pair<EncodedCards, pair<double, int> > & x, const pair<EncodedCards, pair<double, int> > & y)
+    PlayerHands sample(const GameContext &ctx, Rng &rng)
     {
-        return x.second < y.second;
+        return sample(ctx, ctx.possible_hands_a, ctx.cumulative_probability, rng);
+    }
+
+    /** play a card from previous hand */
+    // combo总是prev的子集，按4位计数逐种相减不会借位，整体相减即可
+    EncodedCards playCard (EncodedCards prev, EncodedCards combo)
+    {
+        return prev - combo;
     }
 
-    EncodedCards DetMCTS (EncodedCards lastAction, int myPos)
+    // DetMCTS的采样（确定化）次数，以及每次UCTSearch的迭代次数
+    int det_samples = 100;
+    int uct_iterations = 100;
+    // 搜索阶段的时间预算（毫秒），超出后不再开始新的采样，0表示不限制
+    double time_budget_ms = 0;
+    // 每次搜索的节点预算，节点数达到预算时回收访问次数最少的子树，0表示不限制
+    int node_budget = 100000;
+    // 批量叶节点评估：每一批同时下降的路径数目，为1时退化为逐次评估
+    int leaf_batch_size = 1;
+    // 展开子节点时优先展开出牌后剩余手数少的动作
+    bool order_moves = false;
+    // PUCT选择：大于0时按Q + puct_c * P * sqrt(N父) / (1 + N)选择子节点，P为对手模型给出的先验，
+    // 未访问过的子节点也参与比较（Q取已访问兄弟节点的平均值），被选中时才展开；为0时使用UCT并先逐个展开所有子节点。
+    // 得分与估值函数的量级相当，因此puct_c也在这个量级上
+    double puct_c = 0;
+    // 根节点的预算分配：为真时按轮次在采样之间逐步淘汰候选动作（逐次减半），
+    // 为假时所有采样对全部动作做相同的搜索，再对各采样选出的动作取平均
+    bool sequential_halving = true;
+    // 逐次减半时的置信界宽度（标准差的倍数）：某个动作的上界低于领先者的下界时提前淘汰
+    const double ELIMINATION_Z = 2.0;
+    // 虚拟损失：已选中但尚未回传的路径，每条暂按一次得分为-VIRTUAL_LOSS的访问计入，
+    // 使同一批次中的后续下降倾向于选择其他路径。取值与估值函数的量级相当
+    const double VIRTUAL_LOSS = 50.0;
+
+    // 搜索树节点。子节点的统计量不存放在子节点中，而是作为"边"按结构数组(SoA)
+    // 连续存放在MCTree里，选择子节点时只需顺序扫描父节点对应的一段边数组
+    struct MCTNode
+    {
+        EncodedCards last_action;
+        // 父节点、父节点中指向本节点的边，根节点均为-1
+        int parent, parentEdge;
+        // 本节点的边在MCTree边数组中的区间为[childBegin, childBegin + childCount)
+        int childBegin, childCount;
+        // 已展开的子节点数目。边在节点创建时随机打乱，之后按顺序展开
+        int nExpanded;
+        int curPlayer, dep;
+        // 到达本节点之前连续pass的次数
+        int passes;
+        // 本节点的访问次数（含未回传的虚拟访问）
+        double nEval;
+        bool finishNode;
+    };
+
+    struct MCTree
     {
-        map<EncodedCards, pair<double, int> > answers;
-        for (int T = 0; T < 100; T ++)
+        vector<MCTNode> nodes;
+        // 本次搜索的随机数流，用于打乱子节点的展开顺序
+        Rng rng;
+        // 边的结构数组：动作、访问次数（含虚拟访问）、累计得分（含虚拟损失）、子节点下标（未展开为-1）
+        vector<EncodedCards> edgeAction;
+        vector<double> edgeN, edgeW;
+        // 边的先验概率，只在PUCT模式下计算
+        vector<float> edgeP;
+        vector<int> edgeChild;
+        // bestChild的临时打分缓冲，长度不小于最宽节点的子节点数
+        vector<double> ucb;
+        // 历次搜索中节点数的最大值，clear()时不清零
+        int peakNodes;
+        // 根节点的当前玩家（采样得到的局面中我位于下标2），以及每次搜索的迭代次数（0表示uct_iterations）
+        int rootPlayer, iterations;
+        // 批量叶节点评估的缓冲
+        vector<int> batchLeaves, batchPlayers, batchPasses;
+        vector<EncodedCards> batchStates, batchLastActions;
+        vector<double> batchValues;
+
+        MCTree() : peakNodes(0), rootPlayer(2), iterations(0) {}
+
+        // 树及其缓冲占用的内存（按容量计，clear()之后仍然保留）
+        size_t memoryBytes() const
         {
-            vector<EncodedCards> init_state = sample ();
-            auto answer = UCTSearch (init_state, lastAction, myPos);
-            if (answers.count(answer.first))
+            return nodes.capacity() * sizeof(MCTNode) + ucb.capacity() * sizeof(double) +
+                   (edgeAction.capacity() + batchStates.capacity() + batchLastActions.capacity()) * sizeof(EncodedCards) +
+                   (edgeN.capacity() + edgeW.capacity() + batchValues.capacity()) * sizeof(double) +
+                   edgeP.capacity() * sizeof(float) +
+                   (edgeChild.capacity() + batchLeaves.capacity() + batchPlayers.capacity() + batchPasses.capacity()) * sizeof(int);
+        }
+
+        // 清空整棵树，保留已分配的内存供下一次搜索复用
+        void clear()
+        {
+            nodes.clear();
+            edgeAction.clear();
+            edgeN.clear();
+            edgeW.clear();
+            edgeP.clear();
+            edgeChild.clear();
+        }
+
+        // 在state局面下创建一个节点，last_action为到达该节点的动作，parent为-1时创建根节点
+        int newNode (EncodedCards last_action, int parent, int parentEdge, const PlayerHands & state)
+        {
+            MCTNode node;
+            if (parent != -1)
             {
-                auto prev_ans = answers[answer.first];
-                answers[answer.first] = make_pair((prev_ans.first * (double) prev_ans.second + answer.second)/(double)(prev_ans.second+1), prev_ans.second+1);
+                const MCTNode & p = nodes[parent];
+                // 有人pass时仍需压住之前的牌；连续两家pass则轮到出那手牌的玩家自由出牌
+                if (isPass(last_action))
+                {
+                    node.passes = p.passes + 1;
+                    last_action = node.passes < 2 ? p.last_action : NO_CARDS;
+                }
+                else
+                    node.passes = 0;
+                node.curPlayer = (p.curPlayer + 1) % 3;
+                node.dep = p.dep + 1;
             }
             else
-                answers[answer.first] = make_pair(answer.second, 1);
+            {
+                node.curPlayer = rootPlayer;
+                node.dep = 0;
+                node.passes = 0;
+            }
+            node.last_action = last_action;
+            node.parent = parent;
+            node.parentEdge = parentEdge;
+            node.childBegin = edgeAction.size();
+            node.childCount = 0;
+            node.nExpanded = 0;
+            node.nEval = 0;
+            node.finishNode = parent != -1 && isFinished(state);
+            if (!node.finishNode)
+            {
+                for (EncodedCards action: cachedValidActions(state[node.curPlayer], last_action))
+                {
+                    edgeAction.push_back(action);
+                    edgeN.push_back(0);
+                    edgeW.push_back(0);
+                    edgeP.push_back(0);
+                    edgeChild.push_back(-1);
+                }
+                node.childCount = edgeAction.size() - node.childBegin;
+                // 打乱展开顺序，等价于每次展开时随机挑选一个未展开的子节点
+                rng.shuffle(edgeAction.begin() + node.childBegin, edgeAction.end());
+                // 按出完这手之后最少还需的手数排序，手数相同的仍保持随机顺序
+                if (order_moves)
+                {
+                    EncodedCards hand = state[node.curPlayer];
+                    stable_sort(edgeAction.begin() + node.childBegin, edgeAction.end(), [hand](EncodedCards a, EncodedCards b)
+                    {
+                        return minHands(hand - a) < minHands(hand - b);
+                    });
+                }
+                if (puct_c > 0)
+                    setPriors (node.childBegin, node.childCount, state[node.curPlayer]);
+                if (ucb.size() < (size_t)node.childCount)
+                    ucb.resize(node.childCount);
+            }
+            nodes.push_back(node);
+            peakNodes = max(peakNodes, (int)nodes.size());
+            return nodes.size() - 1;
         }
-        return max_element(answers.begin(), answers.end(), compare)->first;
+
+        // 与getComboProbability相同的对手模型：动作的得分为出这手牌和剩下的牌各需的手数（越小越好），
+        // 概率正比于0.95^k，k为得分不比它差的其他动作个数。手数查最少手数表，得分是小整数，按计数排序O(n)求出k
+        void setPriors (int begin, int n, EncodedCards hand)
+        {
+            static const vector<float> decay = []()
+            {
+                vector<float> table(1024);
+                for (size_t k = 0; k < table.size(); k++)
+                    table[k] = pow(0.95, double(k));
+                return table;
+            }();
+            const int MAX_SCORE = 32;
+            int at_most[MAX_SCORE + 1] = {};
+            for (int i = begin; i < begin + n; i++)
+            {
+                int score = min(MAX_SCORE, int(edgeAction[i] != NO_CARDS) + minHands(hand - edgeAction[i]));
+                edgeP[i] = score;
+                at_most[score] ++;
+            }
+            for (int score = 1; score <= MAX_SCORE; score++)
+                at_most[score] += at_most[score - 1];
+            double total = 0;
+            for (int i = begin; i < begin + n; i++)
+            {
+                int k = min((int)decay.size() - 1, at_most[int(edgeP[i])] - 1);
+                edgeP[i] = decay[k];
+                total += edgeP[i];
+            }
+            for (int i = begin; i < begin + n; i++)
+                edgeP[i] /= total;
+        }
+
+        // 回收访问次数最少的子树，使节点数不超过target。只能在没有未回传路径时调用。
+        // 子节点的访问次数不超过父节点，所以访问次数不超过阈值的节点恰好构成若干棵完整的子树，
+        // 将它们整体删除；其父边保留统计量，再次被选中时重新展开。保留的节点按广度优先顺序重新紧凑存放
+        void recycle(int target)
+        {
+            int need = (int)nodes.size() - target;
+            if (need <= 0)
+                return;
+            vector<double> visits;
+            for (size_t i = 1; i < nodes.size(); i++)
+                visits.push_back(edgeN[nodes[i].parentEdge]);
+            need = min(need, (int)visits.size());
+            nth_element(visits.begin(), visits.begin() + need - 1, visits.end());
+            double threshold = visits[need - 1];
+
+            vector<MCTNode> new_nodes(1, nodes[0]);
+            vector<EncodedCards> new_action;
+            vector<double> new_N, new_W;
+            vector<float> new_P;
+            vector<int> new_child;
+            for (size_t k = 0; k < new_nodes.size(); k++)
+            {
+                // new_nodes[k]的childBegin此时仍指向旧的边数组
+                int old_begin = new_nodes[k].childBegin, count = new_nodes[k].childCount;
+                new_nodes[k].childBegin = new_action.size();
+                for (int j = old_begin; j < old_begin + count; j++)
+                {
+                    int child = edgeChild[j];
+                    new_action.push_back(edgeAction[j]);
+                    new_N.push_back(edgeN[j]);
+                    new_W.push_back(edgeW[j]);
+                    new_P.push_back(edgeP[j]);
+                    if (child != -1 && edgeN[j] > threshold)
+                    {
+                        MCTNode node = nodes[child];
+                        node.parent = k;
+                        node.parentEdge = new_action.size() - 1;
+                        new_child.push_back(new_nodes.size());
+                        new_nodes.push_back(node);
+                    }
+                    else
+                        new_child.push_back(-1);
+                }
+            }
+            nodes.swap(new_nodes);
+            edgeAction.swap(new_action);
+            edgeN.swap(new_N);
+            edgeW.swap(new_W);
+            edgeP.swap(new_P);
+            edgeChild.swap(new_child);
+        }
+    };
+
+    double UCT (const MCTree & tree, int p, int e)
+    {
+        return tree.edgeW[e] / tree.edgeN[e] + sqrt(log(tree.nodes[p].nEval) / tree.edgeN[e]);
+    }
+
+    // 返回UCT值最大的边。父节点的log项每次选择只计算一次，
+    // 打分循环只读取连续的N、W数组，可以被编译器向量化
+    int bestChild (MCTree & tree, int v)
+    {
+        const MCTNode & node = tree.nodes[v];
+        const int n = node.childCount;
+        const double * N = &tree.edgeN[node.childBegin];
+        const double * W = &tree.edgeW[node.childBegin];
+        double * ucb = tree.ucb.data();
+        const double c = sqrt(log(node.nEval));
+        for (int i = 0; i < n; i++)
+            ucb[i] = W[i] / N[i] + c / sqrt(N[i]);
+        int best = 0;
+        for (int i = 1; i < n; i++)
+            if (ucb[i] > ucb[best])
+                best = i;
+        return node.childBegin + best;
+    }
+
+    // PUCT模式下的选择，可能选中尚未展开的边
+    int bestChildPUCT (MCTree & tree, int v)
+    {
+        const MCTNode & node = tree.nodes[v];
+        const int n = node.childCount;
+        const double * N = &tree.edgeN[node.childBegin];
+        const double * W = &tree.edgeW[node.childBegin];
+        const float * P = &tree.edgeP[node.childBegin];
+        double * ucb = tree.ucb.data();
+        double sum = 0;
+        int visited = 0;
+        for (int i = 0; i < n; i++)
+            if (N[i] > 0)
+            {
+                sum += W[i] / N[i];
+                visited ++;
+            }
+        const double fpu = visited ? sum / visited : 0;
+        const double c = puct_c * sqrt(node.nEval);
+        for (int i = 0; i < n; i++)
+            ucb[i] = (N[i] > 0 ? W[i] / N[i] : fpu) + c * P[i] / (1 + N[i]);
+        int best = 0;
+        for (int i = 1; i < n; i++)
+            if (ucb[i] > ucb[best])
+                best = i;
+        return node.childBegin + best;
+    }
+
+    int expand (MCTree & tree, int v, PlayerHands & prev_state)
+    {
+        MCTNode & node = tree.nodes[v];
+        if (node.nExpanded == node.childCount)
+            return -1;
+        int e = node.childBegin + node.nExpanded++;
+        prev_state[node.curPlayer] = playCard (prev_state[node.curPlayer], tree.edgeAction[e]);
+        // newNode可能使node引用失效，之后不再使用node
+        int p = tree.newNode (tree.edgeAction[e], v, e, prev_state);
+        tree.edgeChild[e] = p;
+        return p;
+    }
+    
+    int TreePolicy (MCTree & tree, int v, PlayerHands & init_state)
+    {
+        while (!tree.nodes[v].finishNode)
+        {
+            const MCTNode & node = tree.nodes[v];
+            // v is not fully expanded
+            if (puct_c <= 0 && node.nEval < node.childCount + 1)
+                return expand(tree, v, init_state);
+            int e = puct_c > 0 ? bestChildPUCT (tree, v) : bestChild (tree, v);
+            init_state[node.curPlayer] = playCard(init_state[node.curPlayer], tree.edgeAction[e]);
+            if (tree.edgeChild[e] == -1)
+            {
+                // PUCT模式下第一次选中这条边，或者该子树已被回收，（重新）展开
+                if (tree.edgeN[e] == 0)
+                    tree.nodes[v].nExpanded ++;
+                int p = tree.newNode (tree.edgeAction[e], v, e, init_state);
+                tree.edgeChild[e] = p;
+                return p;
+            }
+            v = tree.edgeChild[e];
+        }
+        return v;
+    }
+    
+    // 同步批量模拟：最多SIM_LANES局互不相关的对局按同一步调推进，每一步每局的当前玩家都按贪心策略出一手，直到各局都有人出完。
+    // 贪心策略只看一张静态的动作顺序表：
+    //   自由出牌时出主牌起点最小的动作，起点相同时出张数最多的，炸弹火箭排在最后；
+    //   压牌时出能压住的最小动作，压不住才用炸弹火箭；农民不压队友的牌。
+    // 动作能否打出只需一次按4位分段的减法（手牌是否包含它）和几次整数比较（能否压住），
+    // AVX2可用时一个256位寄存器同时检查表中连续的4个动作，否则退回到逐个检查的标量实现，两者的结果完全相同
+    const int SIM_LANES = 16;
+    // 为false时总是使用标量实现，用于对比
+    bool sim_use_avx2 = true;
+    // 炸弹和火箭共用的牌型，以及火箭用于比较的大小
+    const long long SIM_BOMB_KEY = 1 << 16, SIM_ROCKET_STR = 100;
+    // 按4位分段的减法中每段的最高位，手牌每种至多4张，置位后逐段相减不会借位
+    const long long SIM_NIBBLE_HIGH = 0x8888888888888888ll;
+    // 表尾的填充项，任何手牌都不包含它，使向量化的检查可以越过表尾读取
+    const long long SIM_PADDING_COMBO = 0x7777777777777777ll;
+
+    // 模拟用的动作表（结构数组）：key为牌型，str为比较大小用的主牌起点，bomb是炸弹火箭的全1掩码
+    struct SimComboList
+    {
+        vector<long long> combo, key, str, bomb;
+        // 非炸弹动作之后是炸弹火箭，从bomb_begin开始
+        int bomb_begin;
+    };
+
+    // 迷你牌堆中所有可能的一手牌，按自由出牌和压牌的偏好各排一份。
+    // lead按(主牌起点, 张数降序)排列，lead_begin[t]为起点不小于t的第一个动作；
+    // follow按(牌型, 主牌起点)排列，key_range中是每种牌型的区间
+    struct SimTables
+    {
+        SimComboList lead, follow;
+        int lead_begin[MAX_CARD_TYPE_NUM + 1];
+        unordered_map<long long, pair<int, int> > key_range;
+    };
+
+    void simComboKey(EncodedCards combo, long long &key, long long &str, bool &bomb)
+    {
+        Hand hand(combo);
+        bomb = hand.isBomb() || hand.isRocket();
+        key = bomb ? SIM_BOMB_KEY : (int(hand.type) * 32 + hand.length) * 8 + hand.appendix;
+        str = hand.isRocket() ? SIM_ROCKET_STR : int(hand.start);
+    }
+
+    SimTables buildSimTables()
+    {
+        struct Entry
+        {
+            EncodedCards combo;
+            long long key, str;
+            bool bomb;
+            int cards;
+        };
+        vector<Entry> entries;
+        for (EncodedCards combo : DoudizhuState(FULL_CARDS, NO_CARDS).validActions())
+        {
+            if (combo == NO_CARDS)
+                continue;
+            Entry e;
+            e.combo = combo;
+            e.cards = cardCount(combo);
+            simComboKey(combo, e.key, e.str, e.bomb);
+            entries.push_back(e);
+        }
+        SimTables tables;
+        auto fill = [&](SimComboList &list)
+        {
+            list.bomb_begin = entries.size();
+            for (size_t i = 0; i < entries.size(); i++)
+            {
+                const Entry &e = entries[i];
+                if (e.bomb)
+                    list.bomb_begin = min(list.bomb_begin, int(i));
+                list.combo.push_back(e.combo);
+                list.key.push_back(e.key);
+                list.str.push_back(e.str);
+                list.bomb.push_back(e.bomb ? -1 : 0);
+            }
+            for (int i = 0; i < 3; i++)
+            {
+                list.combo.push_back(SIM_PADDING_COMBO);
+                list.key.push_back(-1);
+                list.str.push_back(-1);
+                list.bomb.push_back(0);
+            }
+        };
+        sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b)
+        {
+            if (a.bomb != b.bomb)
+                return b.bomb;
+            if (a.str != b.str)
+                return a.str < b.str;
+            if (a.cards != b.cards)
+                return a.cards > b.cards;
+            return a.combo < b.combo;
+        });
+        fill(tables.lead);
+        for (int t = MAX_CARD_TYPE_NUM, i = tables.lead.bomb_begin; t >= 0; t--)
+        {
+            while (i > 0 && tables.lead.str[i - 1] >= t)
+                i--;
+            tables.lead_begin[t] = i;
+        }
+        sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b)
+        {
+            if (a.bomb != b.bomb)
+                return b.bomb;
+            if (a.key != b.key)
+                return a.key < b.key;
+            if (a.str != b.str)
+                return a.str < b.str;
+            return a.combo < b.combo;
+        });
+        fill(tables.follow);
+        for (int i = 0; i < tables.follow.bomb_begin; i++)
+        {
+            auto range = tables.key_range.insert(make_pair(tables.follow.key[i], make_pair(i, i)));
+            range.first->second.second = i + 1;
+        }
+        return tables;
+    }
+
+    const SimTables &simTables()
+    {
+        static const SimTables tables = buildSimTables();
+        return tables;
+    }
+
+    // 需要压的牌：牌型、大小，以及它是炸弹火箭时的大小（否则为-1）。自由出牌时key为-1，表中任何动作都能出
+    struct SimLast
+    {
+        long long key, str, bomb_str;
+    };
+
+    // list[begin, end)中第一个hand能打出、并且能压住last的动作，没有时返回-1
+    int simScanScalar(const SimComboList &list, int begin, int end, long long hand, const SimLast &last)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            if ((((hand | SIM_NIBBLE_HIGH) - list.combo[i]) & SIM_NIBBLE_HIGH) != SIM_NIBBLE_HIGH)
+                continue;
+            if (last.key >= 0 && !(list.key[i] == last.key && list.str[i] > last.str) && !(list.bomb[i] && list.str[i] > last.bomb_str))
+                continue;
+            return i;
+        }
+        return -1;
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("avx2"))) int simScanAVX2(const SimComboList &list, int begin, int end, long long hand, const SimLast &last)
+    {
+        const __m256i high = _mm256_set1_epi64x(SIM_NIBBLE_HIGH);
+        const __m256i h = _mm256_set1_epi64x(hand) | high;
+        const __m256i key = _mm256_set1_epi64x(last.key), str = _mm256_set1_epi64x(last.str), bomb_str = _mm256_set1_epi64x(last.bomb_str);
+        for (int i = begin; i < end; i += 4)
+        {
+            __m256i legal = _mm256_cmpeq_epi64((h - _mm256_loadu_si256((const __m256i *)&list.combo[i])) & high, high);
+            if (last.key >= 0)
+            {
+                __m256i combo_str = _mm256_loadu_si256((const __m256i *)&list.str[i]);
+                __m256i same = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)&list.key[i]), key) & _mm256_cmpgt_epi64(combo_str, str);
+                __m256i bomb = _mm256_loadu_si256((const __m256i *)&list.bomb[i]) & _mm256_cmpgt_epi64(combo_str, bomb_str);
+                legal &= same | bomb;
+            }
+            int bits = _mm256_movemask_pd(_mm256_castsi256_pd(legal));
+            if (end - i < 4)
+                bits &= (1 << (end - i)) - 1;
+            if (bits)
+                return i + __builtin_ctz(bits);
+        }
+        return -1;
+    }
+#endif
+
+    int simScan(const SimComboList &list, int begin, int end, long long hand, const SimLast &last)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        if (sim_use_avx2 && avx2)
+            return simScanAVX2(list, begin, end, hand, last);
+#endif
+        return simScanScalar(list, begin, end, hand, last);
+    }
+
+    // 按贪心策略为hand选出动作，返回它在lead（自由出牌时）或follow表中的下标，-1表示pass
+    int simChoose(const SimTables &tables, EncodedCards hand, const SimLast &last)
+    {
+        if (last.key < 0)
+        {
+            // 手里最小的牌总能单出，所以从最小的牌开始找一定能找到
+            int lowest = __builtin_ctzll(hand) >> 2;
+            return simScan(tables.lead, tables.lead_begin[lowest], tables.lead.combo.size() - 3, hand, last);
+        }
+        const SimComboList &list = tables.follow;
+        if (last.key != SIM_BOMB_KEY)
+        {
+            auto range = tables.key_range.find(last.key);
+            if (range != tables.key_range.end())
+            {
+                int choice = simScan(list, range->second.first, range->second.second, hand, last);
+                if (choice >= 0)
+                    return choice;
+            }
+        }
+        return simScan(list, list.bomb_begin, list.combo.size() - 3, hand, last);
+    }
+
+    // 模拟中的一手：第game局第ply手由player打出action，需要压的牌是last
+    struct SimMove
+    {
+        int game, ply, player;
+        EncodedCards last, action;
+    };
+
+    // 从给定局面开始模拟n局直到有人出完，winners[i]为第i局先出完的玩家（0-2）。
+    // 第i局的三家手牌为hands[3i, 3i+3)，cur[i]为当前玩家，last[i]为需要压的牌（NO_CARDS表示自由出牌），
+    // last_player[i]为打出last[i]的玩家；landlord为地主的玩家编号。moves不为NULL时记录各局的每一手（包括pass）
+    void simulateGames(const EncodedCards *hands, const int *cur, const EncodedCards *last, const int *last_player,
+                       int landlord, int n, int *winners, vector<SimMove> *moves = NULL)
+    {
+        const SimTables &tables = simTables();
+        for (int base = 0; base < n; base += SIM_LANES)
+        {
+            const int lanes = min(SIM_LANES, n - base);
+            EncodedCards h[3][SIM_LANES], lane_last[SIM_LANES];
+            SimLast lane_key[SIM_LANES];
+            int lane_cur[SIM_LANES], lane_last_player[SIM_LANES], ply[SIM_LANES];
+            int active = 0;
+            for (int l = 0; l < lanes; l++)
+            {
+                int g = base + l;
+                for (int k = 0; k < 3; k++)
+                    h[k][l] = hands[3 * g + k];
+                lane_cur[l] = cur[g];
+                lane_last[l] = last[g];
+                lane_last_player[l] = last_player[g];
+                ply[l] = 0;
+                winners[g] = -1;
+                for (int k = 0; k < 3; k++)
+                    if (h[k][l] == NO_CARDS)
+                        winners[g] = k;
+                bool bomb;
+                simComboKey(lane_last[l], lane_key[l].key, lane_key[l].str, bomb);
+                lane_key[l].bomb_str = bomb ? lane_key[l].str : -1;
+                if (lane_last[l] == NO_CARDS)
+                    lane_key[l].key = -1;
+                active += winners[g] < 0;
+            }
+            // 每一步所有未结束的对局各出一手
+            while (active > 0)
+            {
+                for (int l = 0; l < lanes; l++)
+                {
+                    int g = base + l, p = lane_cur[l];
+                    if (winners[g] >= 0)
+                        continue;
+                    int choice = -1;
+                    if (lane_last[l] == NO_CARDS || lane_last_player[l] == landlord || p == landlord)
+                        choice = simChoose(tables, h[p][l], lane_key[l]);
+                    EncodedCards action = NO_CARDS;
+                    if (choice >= 0)
+                    {
+                        const SimComboList &list = lane_last[l] == NO_CARDS ? tables.lead : tables.follow;
+                        action = list.combo[choice];
+                        lane_key[l].key = list.key[choice];
+                        lane_key[l].str = list.str[choice];
+                        lane_key[l].bomb_str = list.bomb[choice] ? list.str[choice] : -1;
+                    }
+                    if (moves)
+                    {
+                        SimMove move = {g, ply[l], p, lane_last[l], action};
+                        moves->push_back(move);
+                    }
+                    if (action != NO_CARDS)
+                    {
+                        h[p][l] -= action;
+                        lane_last[l] = action;
+                        lane_last_player[l] = p;
+                        if (h[p][l] == NO_CARDS)
+                        {
+                            winners[g] = p;
+                            active--;
+                        }
+                    }
+                    // 另外两家都pass了，下一家自由出牌
+                    else if ((p + 1) % 3 == lane_last_player[l])
+                    {
+                        lane_last[l] = NO_CARDS;
+                        lane_key[l].key = -1;
+                    }
+                    lane_cur[l] = (p + 1) % 3;
+                    ply[l]++;
+                }
+            }
+        }
+    }
+
+    // 为true时叶节点不用静态估值，而是从叶节点局面用同步批量模拟以贪心策略下完，按胜负给出±ROLLOUT_VALUE。
+    // 由--rollout打开；加载了估值模型时仍使用估值模型
+    bool rollout_leaves = false;
+    // 与启发式估值的常见幅度（相差三手左右）处于同一量级
+    const double ROLLOUT_VALUE = 30;
+
+    // 叶节点估值，以当前玩家（轮到出牌、需要压lastAction的一方）的视角给出
+    double defaultPolicy (int curPlayer, const EncodedCards * curState, EncodedCards lastAction, int myPos)
+    {
+        int actualPos = (curPlayer+1+myPos)%3;
+        if (value_model.loaded())
+        {
+            EncodedCards prev = curState[(curPlayer+2)%3];
+            // 上家刚出完牌，胜负已定
+            if (prev == NO_CARDS)
+                return actualPos && (actualPos+2)%3 ? value_model.scale : -value_model.scale;
+            int8_t x[VALUE_FEATURES];
+            valueFeatures (curState[curPlayer], curState[(curPlayer+1)%3], prev, lastAction, actualPos, x);
+            return value_model.evaluate (x);
+        }
+        EncodedCards myCard = curState[curPlayer], nextCard = curState[(curPlayer+1)%3], prevCard = curState[(curPlayer+2)%3];
+        // 启发式估值衡量的是各家还需要几手才能出完，手数越多离出完越远，因此取负作为当前玩家一方的得分
+        switch (actualPos)
+        {
+            case 0:
+            case 1:
+                return -evaluate_global_situation (myCard, nextCard, prevCard, actualPos);
+            case 2:
+                return -evaluate_global_situation (myCard, prevCard, nextCard, actualPos);
+        }
+        return 0;
+    }
+
+    // 一次评估一批叶节点。states连续存放n个局面（每个局面3家手牌），
+    // curPlayers[i]、lastActions[i]、passes[i]为第i个局面的当前玩家、待压的牌和此前连续pass的次数，结果写入values
+    void defaultPolicyBatch (const EncodedCards * states, const int * curPlayers, const EncodedCards * lastActions, const int * passes, int n, int myPos, double * values)
+    {
+        if (!rollout_leaves || value_model.loaded())
+        {
+            for (int i = 0; i < n; i++)
+                values[i] = defaultPolicy (curPlayers[i], states + 3 * i, lastActions[i], myPos);
+            return;
+        }
+        // 状态中第i家的座位是(i+1+myPos)%3，地主（座位0）是第(2-myPos)家
+        const int landlord = (5 - myPos) % 3;
+        int lastPlayers[SIM_LANES], winners[SIM_LANES];
+        for (int base = 0; base < n; base += SIM_LANES)
+        {
+            int lanes = min(SIM_LANES, n - base);
+            for (int i = 0; i < lanes; i++)
+                lastPlayers[i] = (curPlayers[base + i] + (passes[base + i] == 0 ? 2 : 1)) % 3;
+            simulateGames (states + 3 * base, curPlayers + base, lastActions + base, lastPlayers, landlord, lanes, winners);
+            for (int i = 0; i < lanes; i++)
+            {
+                int w = winners[i], c = curPlayers[base + i];
+                bool won = w == c || (w != landlord && c != landlord);
+                values[base + i] = won ? ROLLOUT_VALUE : -ROLLOUT_VALUE;
+            }
+        }
+    }
+
+    // 路径选定后、回传之前，对路径上的节点施加虚拟损失
+    void addVirtualLoss (MCTree & tree, int p)
+    {
+        for (; p != -1; p = tree.nodes[p].parent)
+        {
+            const MCTNode & node = tree.nodes[p];
+            tree.nodes[p].nEval += 1;
+            if (node.parentEdge != -1)
+            {
+                tree.edgeN[node.parentEdge] += 1;
+                tree.edgeW[node.parentEdge] -= VIRTUAL_LOSS;
+            }
+        }
+    }
+    
+    void backUp (MCTree & tree, int p, double delta, int myPos, bool virtualLoss = false)
+    {
+        int originalPos = (tree.nodes[p].curPlayer+1+myPos)%3, nowPos;
+        nowPos = originalPos;
+        while (p != -1)
+        {
+            MCTNode & node = tree.nodes[p];
+            // 进入节点p的边由p的上一家选择，按选择者一方的视角记分（地主一方与农民一方零和）
+            int chooser = (nowPos + 2) % 3;
+            double d = (originalPos == 0) == (chooser == 0) ? delta : -delta;
+            // 施加过虚拟损失的路径，访问次数已经计入，只需撤销虚拟损失
+            if (!virtualLoss)
+                node.nEval ++;
+            if (node.parentEdge != -1)
+            {
+                if (virtualLoss)
+                    d += VIRTUAL_LOSS;
+                else
+                    tree.edgeN[node.parentEdge] ++;
+                tree.edgeW[node.parentEdge] += d;
+            }
+            p = node.parent;
+            nowPos = (nowPos + 2)%3;
+        }
+    }
+
+    // rootPasses为轮到我之前连续pass的次数。
+    // 给出rootCandidates（升序）时根节点只搜索其中的动作，搜索结束后第j个候选动作的根边访问次数、累计得分写入rootN[j]、rootW[j]
+    pair<EncodedCards, double> UCTSearch (MCTree & tree, const PlayerHands & init_state, EncodedCards lastAction, int myPos, int rootPasses, const Rng & rng,
+                                          const vector<EncodedCards> * rootCandidates = NULL, double * rootN = NULL, double * rootW = NULL)
+    {
+        tree.clear();
+        tree.rng = rng;
+        int root = tree.newNode (lastAction, -1, -1, init_state), ptr;
+        tree.nodes[root].passes = rootPasses;
+        if (rootCandidates)
+        {
+            // 树中只有根节点，它的边从0开始。保留候选动作，不改变原有的展开顺序
+            int k = 0;
+            double total = 0;
+            for (int e = 0; e < tree.nodes[root].childCount; e++)
+                if (binary_search(rootCandidates->begin(), rootCandidates->end(), tree.edgeAction[e]))
+                {
+                    total += tree.edgeP[e];
+                    tree.edgeP[k] = tree.edgeP[e];
+                    tree.edgeAction[k++] = tree.edgeAction[e];
+                }
+            // 保留的先验重新归一化，否则每轮减半后根节点的PUCT探索项都会变弱；和为0时改用均匀先验
+            for (int e = 0; e < k; e++)
+                tree.edgeP[e] = total > 0 ? tree.edgeP[e] / total : 1.0 / k;
+            tree.nodes[root].childCount = k;
+            tree.edgeAction.resize(k);
+            tree.edgeN.resize(k);
+            tree.edgeW.resize(k);
+            tree.edgeP.resize(k);
+            tree.edgeChild.resize(k);
+        }
+        double delta;
+        tree.nodes[root].nEval = 1;
+        const int iterations = tree.iterations > 0 ? tree.iterations : uct_iterations;
+        if (leaf_batch_size <= 1)
+        {
+            for (int i = 0; i < iterations; i ++)
+            {
+                if (node_budget > 0 && tree.nodes.size() >= (size_t)node_budget)
+                    tree.recycle(node_budget * 3 / 4);
+                PlayerHands curState = init_state;
+                ptr = TreePolicy (tree, root, curState);
+                const MCTNode & leaf = tree.nodes[ptr];
+                if (rollout_leaves && !value_model.loaded())
+                    defaultPolicyBatch (curState.data(), &leaf.curPlayer, &leaf.last_action, &leaf.passes, 1, myPos, &delta);
+                else
+                    delta = defaultPolicy (leaf.curPlayer, curState.data(), leaf.last_action, myPos);
+                backUp (tree, ptr, delta, myPos);
+            }
+        }
+        else
+        {
+            // 批量模式：先沿虚拟损失下降出一批路径，将叶节点局面收集到连续的数组中统一评估，再逐一回传
+            // 批次缓冲放在树中，多次搜索之间复用
+            vector<int> & leaves = tree.batchLeaves, & curPlayers = tree.batchPlayers, & passes = tree.batchPasses;
+            vector<EncodedCards> & states = tree.batchStates, & lastActions = tree.batchLastActions;
+            vector<double> & values = tree.batchValues;
+            leaves.resize(leaf_batch_size);
+            states.resize(3 * leaf_batch_size);
+            curPlayers.resize(leaf_batch_size);
+            passes.resize(leaf_batch_size);
+            lastActions.resize(leaf_batch_size);
+            values.resize(leaf_batch_size);
+            for (int i = 0; i < iterations; i += leaf_batch_size)
+            {
+                int n = min(leaf_batch_size, iterations - i);
+                // 回收只能在整批路径都回传之后进行
+                if (node_budget > 0 && tree.nodes.size() + n > (size_t)node_budget)
+                    tree.recycle(node_budget * 3 / 4);
+                for (int j = 0; j < n; j ++)
+                {
+                    PlayerHands curState = init_state;
+                    leaves[j] = TreePolicy (tree, root, curState);
+                    addVirtualLoss (tree, leaves[j]);
+                    copy (curState.begin(), curState.end(), states.begin() + 3 * j);
+                    curPlayers[j] = tree.nodes[leaves[j]].curPlayer;
+                    lastActions[j] = tree.nodes[leaves[j]].last_action;
+                    passes[j] = tree.nodes[leaves[j]].passes;
+                }
+                defaultPolicyBatch (states.data(), curPlayers.data(), lastActions.data(), passes.data(), n, myPos, values.data());
+                for (int j = 0; j < n; j ++)
+                    backUp (tree, leaves[j], values[j], myPos, true);
+            }
+        }
+        if (rootCandidates)
+        {
+            // 回收之后根节点仍是0号节点，它的边仍从0开始
+            for (int e = 0; e < tree.nodes[root].childCount; e++)
+            {
+                int j = lower_bound(rootCandidates->begin(), rootCandidates->end(), tree.edgeAction[e]) - rootCandidates->begin();
+                rootN[j] = tree.edgeN[e];
+                rootW[j] = tree.edgeW[e];
+            }
+        }
+        if (puct_c > 0)
+        {
+            // PUCT模式下选访问次数最多的动作，部分动作可能从未被访问
+            const MCTNode & r = tree.nodes[root];
+            int e = max_element(tree.edgeN.begin() + r.childBegin, tree.edgeN.begin() + r.childBegin + r.childCount) - tree.edgeN.begin();
+            return make_pair(tree.edgeAction[e], tree.edgeW[e] / max(1.0, tree.edgeN[e]));
+        }
+        int e = bestChild(tree, root);
+        delta = UCT(tree, root, e);
+        return make_pair(tree.edgeAction[e], delta);
+    }
+
+    bool compare (const pair<EncodedCards, pair<double, double> > & x, const pair<EncodedCards, pair<double, double> > & y)
+    {
+        return x.second < y.second;
+    }
+
+    // 统计一棵搜索完的树：节点数、深度、有效分支因子，以及根节点各动作的访问次数
+    void collectTreeStats (const MCTree & tree, EncodedCards best, double sample_ms, double search_ms, TreeStats & stats)
+    {
+        stats.done = true;
+        stats.nodes = tree.nodes.size();
+        stats.best = best;
+        stats.sample_ms = sample_ms;
+        stats.search_ms = search_ms;
+        long long depth_sum = 0, expanded = 0, width = 0;
+        int interior = 0;
+        stats.max_depth = 0;
+        for (const MCTNode & node : tree.nodes)
+        {
+            depth_sum += node.dep;
+            stats.max_depth = max(stats.max_depth, node.dep);
+            if (!node.finishNode && node.nExpanded > 0)
+            {
+                interior ++;
+                expanded += node.nExpanded;
+                width += node.childCount;
+            }
+        }
+        stats.mean_depth = stats.nodes ? double(depth_sum) / stats.nodes : 0;
+        stats.branching = interior ? double(expanded) / interior : 0;
+        stats.width = interior ? double(width) / interior : 0;
+        const MCTNode & root = tree.nodes[0];
+        stats.root_visits.clear();
+        for (int e = root.childBegin; e < root.childBegin + root.childCount; e++)
+            stats.root_visits.push_back(make_pair(tree.edgeAction[e], tree.edgeN[e]));
+    }
+
+    // 一个确定化：三家当前的手牌，以及它在采样中被抽中的次数。相同的确定化只搜索一次，
+    // 迭代次数和汇总时的权重都按次数成倍计算
+    struct Determinization
+    {
+        PlayerHands state;
+        int multiplicity;
+    };
+
+    // 为true时采样数随后验分布的熵自适应：取后验困惑度exp(H)（等效的手牌种数）的DET_SAMPLES_PER_HAND倍，
+    // 限制在[MIN_DET_SAMPLES, det_samples]之间。后期后验只剩几种手牌时采样数随之减少
+    bool adaptive_determinizations = true;
+    const double DET_SAMPLES_PER_HAND = 4;
+    const int MIN_DET_SAMPLES = 8;
+    // 抽取确定化所用的随机数流编号，与各确定化的搜索所用的流不重叠
+    const unsigned long long DETERMINIZATION_STREAM = 1ull << 33;
+
+    // 系统抽样：在后验的cdf上取n个间隔为1/n、起点随机的点，落在同一手牌上的点合并为一个确定化。
+    // 每种手牌被抽中的次数与n*p相差不到1，比独立抽样覆盖得更均匀。返回的顺序是随机的，
+    // 超出时间预算时被舍弃的确定化不会偏向枚举顺序靠后的手牌
+    vector<Determinization> drawDeterminizations (GameContext &ctx, Rng rng)
+    {
+        const vector<double> &cdf = ctx.cumulative_probability;
+        int n = det_samples;
+        if (adaptive_determinizations)
+        {
+            double entropy = 0, prev = 0;
+            for (double c : cdf)
+            {
+                if (c > prev)
+                    entropy -= (c - prev) * log(c - prev);
+                prev = c;
+            }
+            n = max(min(MIN_DET_SAMPLES, det_samples), min(det_samples, int(ceil(DET_SAMPLES_PER_HAND * exp(entropy)))));
+        }
+        vector<Determinization> dets;
+        ctx.search_determinizations = 0;
+        if (cdf.empty())
+            return dets;
+        double offset = rng.nextDouble();
+        size_t j = 0, last = 0;
+        for (int i = 0; i < n; i++)
+        {
+            double u = (i + offset) / n;
+            while (j + 1 < cdf.size() && cdf[j] < u)
+                j++;
+            // 与上一个采样落在同一手牌上时只增加次数，第一个采样总是新加入
+            if (!dets.empty() && j == last)
+                dets.back().multiplicity++;
+            else
+            {
+                Determinization det = {currentHands(ctx, ctx.possible_hands_a[j]), 1};
+                dets.push_back(det);
+                last = j;
+            }
+        }
+        rng.shuffle(dets.begin(), dets.end());
+        ctx.search_determinizations = dets.size();
+        return dets;
+    }
+
+    // 记录搜索树的节点数峰值，以及这些树同时占用的内存
+    void recordTreeMemory(GameContext &ctx, const vector<MCTree> &trees)
+    {
+        long long bytes = 0;
+        for (const MCTree &tree : trees)
+        {
+            ctx.search_peak_nodes = max(ctx.search_peak_nodes, tree.peakNodes);
+            bytes += tree.memoryBytes();
+        }
+        ctx.alloc.tree_bytes = max(ctx.alloc.tree_bytes, bytes);
+    }
+
+    // 逐次减半：每轮用一批采样搜索仍存活的候选动作，记录每个动作在每个采样中的平均得分；
+    // 轮末先淘汰置信上界低于领先者置信下界的动作，再按平均得分保留前一半。
+    // 剩余的确定化平均分给剩余轮数，只剩一个动作（领先者已不可能被超越）时提前结束。
+    // 每个确定化的得分按它的次数加权
+    EncodedCards sequentialHalving (GameContext &ctx, EncodedCards lastAction, int myPos, vector<EncodedCards> actions,
+                                    const vector<Determinization> &dets, double sample_ms)
+    {
+        ThreadPool &pool = threadPool();
+        vector<MCTree> trees(pool.size());
+        Rng root_rng(search_seed);
+        auto start = chrono::steady_clock::now();
+        sort(actions.begin(), actions.end());
+        const int k = actions.size();
+        // 各动作的得分在采样之间的（加权）和、平方和，以及搜索到该动作的采样数
+        vector<double> sum(k, 0), sum_sq(k, 0);
+        vector<double> count(k, 0);
+        // 预想阶段已经得到的统计作为先验
+        if (ctx.root_prior)
+            for (int i = 0; i < k; i++)
+            {
+                auto it = ctx.root_prior->find(actions[i]);
+                if (it != ctx.root_prior->end())
+                {
+                    sum[i] = it->second.sum;
+                    sum_sq[i] = it->second.sum_sq;
+                    count[i] = it->second.count;
+                }
+            }
+        // 流水线模式下后验完成之前的采样，按重要性权重计入
+        for (const EarlySample &e : ctx.early_samples)
+            for (int i = 0; i < k; i++)
+                if (e.weight > 0 && e.N[i] > 0)
+                {
+                    double x = e.W[i] / e.N[i];
+                    sum[i] += e.weight * x;
+                    sum_sq[i] += e.weight * x * x;
+                    count[i] += e.weight;
+                }
+        auto mean = [&](int i) { return count[i] ? sum[i] / count[i] : -numeric_limits<double>::infinity(); };
+        auto radius = [&](int i)
+        {
+            if (count[i] < 2)
+                return numeric_limits<double>::infinity();
+            double m = sum[i] / count[i];
+            return ELIMINATION_Z * sqrt(max(0.0, sum_sq[i] / count[i] - m * m) / (count[i] - 1));
+        };
+        vector<int> alive(k);
+        for (int i = 0; i < k; i++)
+            alive[i] = i;
+        int next = 0;
+        bool timeout = false;
+        const int total = dets.size();
+        while (alive.size() > 1 && next < total)
+        {
+            int m = alive.size(), rounds = 0;
+            while ((1 << rounds) < m)
+                rounds ++;
+            int n = max(1, (total - next) / rounds);
+            vector<EncodedCards> candidates(m);
+            for (int j = 0; j < m; j++)
+                candidates[j] = actions[alive[j]];
+            vector<double> N(n * m, 0), W(n * m, 0);
+            vector<char> finished(n, 0);
+            pool.parallelFor(n, [&](int t, int worker)
+            {
+                // 与均匀分配相同，第T个确定化的搜索只依赖于(search_seed, T)，第一个确定化总会完成
+                int T = next + t;
+                if (T > 0 && time_budget_ms > 0 &&
+                    chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() >= time_budget_ms)
+                    return;
+                Rng rng = root_rng.stream(T);
+                auto t1 = chrono::steady_clock::now();
+                trees[worker].iterations = uct_iterations * dets[T].multiplicity;
+                PlayerHands init_state = dets[T].state;
+                EncodedCards best = UCTSearch (trees[worker], init_state, lastAction, myPos, ctx.root_passes, rng.stream(0), &candidates, &N[t * m], &W[t * m]).first;
+                if (ctx.collect_telemetry)
+                    collectTreeStats (trees[worker], best, sample_ms,
+                                      chrono::duration<double, milli>(chrono::steady_clock::now() - t1).count(), ctx.tree_stats[T]);
+                finished[t] = 1;
+            });
+            next += n;
+            for (int t = 0; t < n; t++)
+            {
+                if (!finished[t])
+                {
+                    timeout = true;
+                    continue;
+                }
+                int weight = dets[next - n + t].multiplicity;
+                ctx.search_samples += weight;
+                for (int j = 0; j < m; j++)
+                    if (N[t * m + j] > 0)
+                    {
+                        double x = W[t * m + j] / N[t * m + j];
+                        sum[alive[j]] += weight * x;
+                        sum_sq[alive[j]] += weight * x * x;
+                        count[alive[j]] += weight;
+                    }
+            }
+            if (timeout)
+                break;
+            int best = *max_element(alive.begin(), alive.end(), [&](int a, int b) { return mean(a) < mean(b); });
+            double lower = mean(best) - radius(best);
+            vector<int> kept;
+            for (int i : alive)
+                if (i == best || mean(i) + radius(i) >= lower)
+                    kept.push_back(i);
+            stable_sort(kept.begin(), kept.end(), [&](int a, int b) { return mean(a) > mean(b); });
+            kept.resize(min((int)kept.size(), (m + 1) / 2));
+            sort(kept.begin(), kept.end());
+            alive.swap(kept);
+        }
+        recordTreeMemory(ctx, trees);
+        return actions[*max_element(alive.begin(), alive.end(), [&](int a, int b) { return mean(a) < mean(b); })];
+    }
+
+    // 流水线式地构造后验并搜索：一个生产者线程按遍历顺序逐个完成枚举子任务并发布结果，
+    // 与此同时线程池从已发布的手牌组成的部分后验q中采样搜索，不必等枚举全部结束。
+    // 后验完成后，对仍保留在完整后验p中的手牌，p/q等于部分后验与完整后验归一化常数之比，
+    // 其余手牌为0；这些采样按该重要性权重计入DetMCTS的汇总。
+    // 后验完成前的采样数取决于线程调度，所以此模式下相同的种子不保证复现同一决策
+    bool pipeline_posterior = false;
+
+    // 后验完成前的采样使用的随机数流编号从这里开始，与DetMCTS的采样编号不重叠
+    const unsigned long long EARLY_SAMPLE_STREAM = 1ull << 32;
+
+    void pipelinedPosterior(GameContext &ctx, CardCounter known_cards_a, EncodedCards lastAction, int myPos)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        EncodedCards my_hand = ctx.encoded_my_initial_cards - ctx.cards_played_c;
+        vector<EncodedCards> root_actions = cachedValidActions(my_hand, lastAction);
+        // 与DetMCTS相同，不需要搜索的局面直接构造后验
+        if (root_actions.size() == 1 || find(root_actions.begin(), root_actions.end(), my_hand) != root_actions.end())
+        {
+            buildPosterior(ctx, known_cards_a);
+            return;
+        }
+        sort(root_actions.begin(), root_actions.end());
+        const int k = root_actions.size();
+
+        vector<PosteriorTask> tasks;
+        preparePosterior(ctx, known_cards_a, tasks);
+        vector<PosteriorBuffer> buffers(tasks.size());
+        // buffers[0, published)已经完成，之后不再修改
+        atomic<int> published(0);
+        AllocReport *report = alloc_report;
+        thread producer([&]
+        {
+            alloc_report = report;
+            for (size_t t = 0; t < tasks.size(); t++)
+            {
+                transverseAllHands(ctx, tasks[t].cur, tasks[t].known_cards_a, buffers[t]);
+                published.store(t + 1, memory_order_release);
+            }
+        });
+
+        ThreadPool &pool = threadPool();
+        vector<MCTree> trees(pool.size());
+        Rng root_rng(search_seed);
+        // 当前的部分后验，只在有新的子任务发布时重建
+        vector<EncodedCards> hands;
+        vector<double> cdf;
+        double mass = 0;
+        int seen = 0;
+        while (published.load(memory_order_acquire) < (int)tasks.size() && (int)ctx.early_samples.size() < det_samples)
+        {
+            int p = published.load(memory_order_acquire);
+            if (p != seen)
+            {
+                seen = p;
+                double threshold = posterior_epsilon * ctx.posterior_best_weight.load();
+                hands.clear();
+                cdf.clear();
+                mass = 0;
+                for (int t = 0; t < p; t++)
+                    for (size_t i = 0; i < buffers[t].hands.size(); i++)
+                    {
+                        double w = buffers[t].weights[i];
+                        if (w <= 0 || w < threshold)
+                            continue;
+                        mass += w;
+                        cdf.push_back(mass);
+                        hands.push_back(buffers[t].hands[i]);
+                    }
+                for (double &c : cdf)
+                    c /= mass;
+            }
+            if (hands.empty() || mass <= 0)
+            {
+                this_thread::yield();
+                continue;
+            }
+            int n = pool.size(), base = ctx.early_samples.size();
+            vector<EarlySample> batch(n);
+            pool.parallelFor(n, [&](int t, int worker)
+            {
+                Rng rng = root_rng.stream(EARLY_SAMPLE_STREAM + base + t);
+                PlayerHands init_state = sample (ctx, hands, cdf, rng);
+                EarlySample &e = batch[t];
+                e.hand_a = init_state[0] + ctx.cards_played_a;
+                e.weight = mass;
+                e.N.assign(k, 0);
+                e.W.assign(k, 0);
+                pair<EncodedCards, double> answer = UCTSearch (trees[worker], init_state, lastAction, myPos, ctx.root_passes, rng.stream(0), &root_actions, &e.N[0], &e.W[0]);
+                e.best = answer.first;
+                e.value = answer.second;
+            });
+            for (EarlySample &e : batch)
+                ctx.early_samples.push_back(move(e));
+        }
+        producer.join();
+        finishPosterior(ctx, buffers);
+
+        // 重要性权重：q(h) = w(h) / 部分后验的归一化常数，p(h) = w(h) / posterior_mass
+        vector<EncodedCards> kept(ctx.possible_hands_a);
+        sort(kept.begin(), kept.end());
+        for (EarlySample &e : ctx.early_samples)
+            e.weight = binary_search(kept.begin(), kept.end(), e.hand_a) ? e.weight / ctx.posterior_mass : 0;
+        recordTreeMemory(ctx, trees);
+        ctx.posterior_build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+
+    EncodedCards DetMCTS (GameContext &ctx, EncodedCards lastAction, int myPos)
+    {
+        ctx.search_samples = 0;
+        ctx.search_determinizations = 0;
+        // 根节点的动作只取决于我自己的手牌，对所有采样都相同
+        EncodedCards my_hand = ctx.encoded_my_initial_cards - ctx.cards_played_c;
+        vector<EncodedCards> root_actions = cachedValidActions(my_hand, lastAction);
+        // 只有一种选择（包括只能pass）时不必搜索
+        if (root_actions.size() == 1)
+            return root_actions[0];
+        // 能一手出完时直接出完
+        if (find(root_actions.begin(), root_actions.end(), my_hand) != root_actions.end())
+            return my_hand;
+        // 按信念两家都不可能压过的一手，出完后剩下的牌又能一手出完，就一定能赢，不必采样搜索。
+        // 只在后验精确（没有按似然剪枝）时可靠：剪掉的手牌可能正好压得过
+        if (posterior_epsilon <= 0 && posterior_top_k <= 0)
+            for (EncodedCards action : root_actions)
+            {
+                if (isPass(action) || probCanBeat(ctx.beliefs, 0, action) > 0 || probCanBeat(ctx.beliefs, 1, action) > 0)
+                    continue;
+                EncodedCards rest = my_hand - action;
+                const vector<EncodedCards> &leads = cachedValidActions(rest, NO_CARDS);
+                if (find(leads.begin(), leads.end(), rest) != leads.end())
+                    return action;
+            }
+        Rng root_rng(search_seed);
+        auto t0 = chrono::steady_clock::now();
+        ctx.alloc.enter(PHASE_SAMPLING);
+        vector<Determinization> dets = drawDeterminizations (ctx, root_rng.stream(DETERMINIZATION_STREAM));
+        ctx.alloc.enter(PHASE_SEARCH);
+        // 后验为空时没有可搜索的局面，退回第一个合法动作
+        if (dets.empty())
+            return root_actions[0];
+        const int total = dets.size();
+        // 抽取确定化的耗时平均分摊到每个确定化上
+        const double sample_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count() / total;
+        if (ctx.collect_telemetry)
+            ctx.tree_stats.assign(total, TreeStats());
+        if (sequential_halving)
+            return sequentialHalving (ctx, lastAction, myPos, root_actions, dets, sample_ms);
+        ThreadPool &pool = threadPool();
+        // 每个线程一棵搜索树，同一线程上的所有采样共用这棵树的内存
+        vector<MCTree> trees(pool.size());
+        vector<pair<EncodedCards, double> > results(total);
+        vector<char> finished(total, 0);
+        auto start = chrono::steady_clock::now();
+        pool.parallelFor(total, [&](int T, int worker)
+        {
+            // 超出时间预算后不再开始新的采样，但第一个采样总会完成
+            if (T > 0 && time_budget_ms > 0 &&
+                chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() >= time_budget_ms)
+                return;
+            // 第T个确定化使用独立的随机数流，搜索只依赖于(search_seed, T)
+            Rng rng = root_rng.stream(T);
+            auto t1 = chrono::steady_clock::now();
+            trees[worker].iterations = uct_iterations * dets[T].multiplicity;
+            PlayerHands init_state = dets[T].state;
+            results[T] = UCTSearch (trees[worker], init_state, lastAction, myPos, ctx.root_passes, rng.stream(0));
+            if (ctx.collect_telemetry)
+                collectTreeStats (trees[worker], results[T].first, sample_ms,
+                                  chrono::duration<double, milli>(chrono::steady_clock::now() - t1).count(), ctx.tree_stats[T]);
+            finished[T] = 1;
+        });
+        // 按采样编号顺序汇总，使结果与线程数无关
+        // 每个动作的加权平均得分和总权重，后验完成之前的采样按重要性权重计入
+        map<EncodedCards, pair<double, double> > answers;
+        auto add = [&](const pair<EncodedCards, double> &answer, double weight)
+        {
+            if (answers.count(answer.first))
+            {
+                auto prev_ans = answers[answer.first];
+                answers[answer.first] = make_pair((prev_ans.first * prev_ans.second + answer.second * weight) / (prev_ans.second + weight), prev_ans.second + weight);
+            }
+            else
+                answers[answer.first] = make_pair(answer.second, weight);
+        };
+        for (const EarlySample &e : ctx.early_samples)
+            if (e.weight > 0)
+                add(make_pair(e.best, e.value), e.weight);
+        for (int T = 0; T < total; T ++)
+        {
+            if (!finished[T])
+                continue;
+            ctx.search_samples += dets[T].multiplicity;
+            add(results[T], dets[T].multiplicity);
+        }
+        recordTreeMemory(ctx, trees);
+        return max_element(answers.begin(), answers.end(), compare)->first;
     }
+
+    // 预想（ponder）：长时运行时，我出牌后、两个对手出牌期间，在后台从下家将要出牌的局面继续采样搜索。
+    // 每棵树搜索结束后，取出"下家的回应-上家的回应-轮到我"两层之下我的各个动作的平均得分，
+    // 按两家的回应分别累加；真正的请求到来时，与实际回应相符的统计交给逐次减半作为先验
+    bool ponder = false;
+    // 预想时每棵树的迭代次数、计入统计所需的最少访问次数，以及预想最多进行的采样数
+    int ponder_iterations = 400;
+    int ponder_min_visits = 8;
+    int ponder_max_samples = 2000;
+
+    struct PonderSample
+    {
+        EncodedCards reply_a, reply_b, action;
+        double value;
+    };
+
+    class Ponderer
+    {
+    public:
+        Ponderer() : stopping(false), samples(0) {}
+
+        ~Ponderer()
+        {
+            stop();
+        }
+
+        // ctx为刚做完的决策所用的上下文，其中已计入我出的牌；last、passes为下家面对的局面
+        void start(unique_ptr<GameContext> context, int pos, EncodedCards last, int passes)
+        {
+            stop();
+            ctx = move(context);
+            my_pos = pos;
+            last_action = last;
+            root_passes = passes;
+            stats.clear();
+            samples = 0;
+            stopping = false;
+            worker = thread(&Ponderer::run, this);
+        }
+
+        // 停止预想，正在进行的采样完成后返回
+        void stop()
+        {
+            stopping = true;
+            if (worker.joinable())
+                worker.join();
+        }
+
+        // 下家、上家分别出了reply_a、reply_b之后，我的各个动作的统计，没有时返回NULL。只能在stop()之后调用
+        const map<EncodedCards, RootStat> *prior(EncodedCards reply_a, EncodedCards reply_b) const
+        {
+            auto it = stats.find(make_pair(reply_a, reply_b));
+            return it == stats.end() ? NULL : &it->second;
+        }
+
+        int sampleCount() const
+        {
+            return samples;
+        }
+
+    private:
+        void run()
+        {
+            ThreadPool &pool = threadPool();
+            vector<MCTree> trees(pool.size());
+            for (MCTree &tree : trees)
+            {
+                tree.rootPlayer = 0;
+                tree.iterations = ponder_iterations;
+            }
+            // 与决策时的采样使用不同的随机数流
+            Rng root_rng = Rng(search_seed).stream(~0ull);
+            const int n = pool.size();
+            vector<vector<PonderSample> > results(n);
+            vector<char> finished(n);
+            while (!stopping && samples < ponder_max_samples)
+            {
+                finished.assign(n, 0);
+                pool.parallelFor(n, [&](int t, int w)
+                {
+                    results[t].clear();
+                    if (stopping)
+                        return;
+                    Rng rng = root_rng.stream(samples + t);
+                    PlayerHands init_state = sample (*ctx, rng);
+                    MCTree &tree = trees[w];
+                    UCTSearch (tree, init_state, last_action, my_pos, root_passes, rng.stream(0));
+                    const MCTNode &root = tree.nodes[0];
+                    for (int e1 = root.childBegin; e1 < root.childBegin + root.childCount; e1++)
+                    {
+                        int b = tree.edgeChild[e1];
+                        if (b == -1 || tree.nodes[b].finishNode)
+                            continue;
+                        for (int e2 = tree.nodes[b].childBegin; e2 < tree.nodes[b].childBegin + tree.nodes[b].childCount; e2++)
+                        {
+                            int me = tree.edgeChild[e2];
+                            if (me == -1 || tree.nodes[me].finishNode || tree.edgeN[e2] < ponder_min_visits)
+                                continue;
+                            const MCTNode &node = tree.nodes[me];
+                            for (int e3 = node.childBegin; e3 < node.childBegin + node.childCount; e3++)
+                                if (tree.edgeN[e3] > 0)
+                                    results[t].push_back({tree.edgeAction[e1], tree.edgeAction[e2], tree.edgeAction[e3],
+                                                          tree.edgeW[e3] / tree.edgeN[e3]});
+                        }
+                    }
+                    finished[t] = 1;
+                });
+                for (int t = 0; t < n; t++)
+                {
+                    if (!finished[t])
+                        continue;
+                    samples ++;
+                    for (const PonderSample &s : results[t])
+                    {
+                        RootStat &stat = stats[make_pair(s.reply_a, s.reply_b)][s.action];
+                        stat.sum += s.value;
+                        stat.sum_sq += s.value * s.value;
+                        stat.count ++;
+                    }
+                }
+            }
+        }
+
+        unique_ptr<GameContext> ctx;
+        thread worker;
+        atomic<bool> stopping;
+        int my_pos, root_passes, samples;
+        EncodedCards last_action;
+        map<pair<EncodedCards, EncodedCards>, map<EncodedCards, RootStat> > stats;
+    };
 }
-void botzone()
+// 进程的内存占用峰值（KB）
+long peakRssKB()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// new和delete都不内联：否则编译器在调用处看到malloc与delete、new与free配对，会误报不匹配
+// 计入本线程所属决策的当前阶段的一次分配；ALLOC_STATS下还累计块的实际大小，并更新存活堆及其峰值
+inline void countAllocation(void *p)
+{
+    using namespace doudizhu;
+    AllocReport *report = alloc_report;
+    int phase = report ? report->counters.phase.load(memory_order_relaxed) : PHASE_OTHER;
+    if (report)
+        report->counters.allocs[phase].fetch_add(1, memory_order_relaxed);
+#ifdef ALLOC_STATS
+    if (!p)
+        return;
+    long long size = malloc_usable_size(p);
+    if (report)
+        report->counters.bytes[phase].fetch_add(size, memory_order_relaxed);
+    long long live = live_heap_bytes.fetch_add(size, memory_order_relaxed) + size;
+    long long peak = peak_heap_bytes.load(memory_order_relaxed);
+    while (live > peak && !peak_heap_bytes.compare_exchange_weak(peak, live, memory_order_relaxed))
+        ;
+#else
+    (void)p;
+#endif
+}
+
+// 计入本线程所属决策的当前阶段的一次释放，只在ALLOC_STATS下统计
+inline void countFree(void *p)
+{
+#ifdef ALLOC_STATS
+    using namespace doudizhu;
+    if (!p)
+        return;
+    if (AllocReport *report = alloc_report)
+        report->counters.frees[report->counters.phase.load(memory_order_relaxed)].fetch_add(1, memory_order_relaxed);
+    live_heap_bytes.fetch_sub(malloc_usable_size(p), memory_order_relaxed);
+#else
+    (void)p;
+#endif
+}
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    if (void *p = malloc(size ? size : 1))
+    {
+        if (doudizhu::count_allocations)
+            countAllocation(p);
+        return p;
+    }
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void *operator new(size_t size, const nothrow_t &) noexcept
+{
+    void *p = malloc(size ? size : 1);
+    if (doudizhu::count_allocations)
+        countAllocation(p);
+    return p;
+}
+
+__attribute__((noinline)) void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+__attribute__((noinline)) void *operator new[](size_t size, const nothrow_t &tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+// 关闭计数之前分配的块在打开之后释放（或者反过来）会让存活堆的统计偏差一个块，
+// 所以count_allocations只在main解析参数时设置，之后不再改变
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    if (doudizhu::count_allocations)
+        countFree(p);
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, const nothrow_t &) noexcept
+{
+    operator delete(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept
+{
+    operator delete(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, const nothrow_t &) noexcept
+{
+    operator delete(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+// 对局记录（trace）的二进制格式：16字节的文件头之后是连续的定长记录，每条记录对应一次出牌决策。
+// 同一局的记录按ply递增连续存放，从初始手牌依次减去各手的action即可还原每一步的局面
+const char TRACE_MAGIC[8] = {'D', 'D', 'Z', 'T', 'R', 'A', 'C', 'E'};
+const uint32_t TRACE_VERSION = 1;
+// 三家的初始手牌都已知（自我对局）；只有本方的初始手牌时，其他两项为0
+const uint8_t TRACE_HANDS_KNOWN = 1;
+// 对局结果已知时标记获胜的一方
+const uint8_t TRACE_LANDLORD_WON = 2;
+const uint8_t TRACE_FARMERS_WON = 4;
+
+struct TraceRecord
+{
+    // 对局编号：自我对局中为局号，平台对局中为本方初始手牌的散列，用于把同一局的记录归在一起
+    uint32_t game;
+    // 本次决策之前已经出过的手数，以及决策者的座位（0为地主）
+    uint16_t ply;
+    uint8_t seat;
+    uint8_t flags;
+    // 按座位存放的初始手牌（地主的包含公开牌）
+    doudizhu::EncodedCards initial_hands[3];
+    // 需要压的牌（NO_CARDS表示可以任意出）和选择的动作
+    doudizhu::EncodedCards last_action, action;
+    // 搜索统计：完成的采样数、单棵树节点峰值、后验保留的手牌数、决策耗时（微秒）
+    uint32_t samples, peak_nodes, posterior_kept, decision_us;
+};
+static_assert(sizeof(TraceRecord) == 64, "trace records must stay fixed-width");
+
+struct TraceHeader
+{
+    char magic[8];
+    uint32_t version, record_size;
+};
+
+// 追加写入trace文件，可以在多个线程中同时调用
+class TraceWriter
+{
+public:
+    TraceWriter() : file(NULL) {}
+    ~TraceWriter()
+    {
+        if (file)
+            fclose(file);
+    }
+
+    bool open(const string &path)
+    {
+        file = fopen(path.c_str(), "ab");
+        if (!file)
+            return false;
+        // 新文件先写文件头
+        if (ftell(file) == 0)
+        {
+            TraceHeader header;
+            memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+            header.version = TRACE_VERSION;
+            header.record_size = sizeof(TraceRecord);
+            fwrite(&header, sizeof(header), 1, file);
+        }
+        return true;
+    }
+
+    bool enabled() const
+    {
+        return file != NULL;
+    }
+
+    void write(const TraceRecord *records, size_t n)
+    {
+        if (!file || n == 0)
+            return;
+        lock_guard<mutex> lock(m);
+        fwrite(records, sizeof(TraceRecord), n, file);
+        fflush(file);
+    }
+
+private:
+    FILE *file;
+    mutex m;
+};
+
+// 由--trace打开；未打开时不记录
+TraceWriter trace_writer;
+
+// 搜索遥测：每次搜索的决策写一行JSON，多线程写入时整行加锁
+class TelemetryWriter
+{
+public:
+    TelemetryWriter() : file(NULL) {}
+    ~TelemetryWriter()
+    {
+        if (file)
+            fclose(file);
+    }
+
+    bool open(const string &path)
+    {
+        file = fopen(path.c_str(), "a");
+        return file != NULL;
+    }
+
+    bool enabled() const
+    {
+        return file != NULL;
+    }
+
+    void write(const Json::Value &line)
+    {
+        if (!file)
+            return;
+        Json::FastWriter writer;
+        string text = writer.write(line);
+        lock_guard<mutex> lock(m);
+        fwrite(text.data(), 1, text.size(), file);
+        fflush(file);
+    }
+
+private:
+    FILE *file;
+    mutex m;
+};
+
+// 由--telemetry打开；未打开时不收集搜索统计
+TelemetryWriter telemetry_writer;
+
+// 按点数从小到大写出一手牌，如"99TT"；10记为T，小王、大王记为w、W
+string cardsName(doudizhu::EncodedCards cards)
+{
+    using namespace doudizhu;
+    static const char names[] = "3456789TJQKA2wW";
+    if (cards == NO_CARDS)
+        return "pass";
+    string name;
+    for (int i = 0; i < MAX_CARD_TYPE_NUM; i++)
+        name.append(numCardOfEncoded(CardType(i), cards), names[i]);
+    return name;
+}
+
+// 一次决策的搜索遥测：各阶段耗时、采样之间的一致程度、树的规模和形状，以及根节点各动作的访问次数
+Json::Value searchTelemetry(const doudizhu::GameContext &ctx, doudizhu::EncodedCards action, double search_ms, double total_ms)
+{
+    using namespace doudizhu;
+    Json::Value line;
+    line["action"] = cardsName(action);
+    line["samples"] = ctx.search_samples;
+    line["determinizations"] = ctx.search_determinizations;
+    line["early_samples"] = (int)ctx.early_samples.size();
+    // 按信念估计的下家、上家能压过所选动作的概率
+    line["beat_next"] = probCanBeat(ctx.beliefs, 0, action);
+    line["beat_prev"] = probCanBeat(ctx.beliefs, 1, action);
+    // 各阶段的耗时和堆分配；分配次数只在count_allocations打开时统计，
+    // 字节数、释放次数和存活堆峰值还需要ALLOC_STATS，峰值在与其他决策重叠时省略
+    Json::Value phases;
+    for (int p = PHASE_PARSE; p < PHASE_NUM; p++)
+    {
+        Json::Value phase;
+        phase["ms"] = ctx.alloc.ms[p];
+        if (count_allocations)
+            phase["allocs"] = (double)ctx.alloc.allocs[p];
+        if (count_allocations && ALLOC_BYTES_TRACKED)
+        {
+            phase["frees"] = (double)ctx.alloc.frees[p];
+            phase["bytes"] = (double)ctx.alloc.bytes[p];
+        }
+        phases[PHASE_NAMES[p]] = phase;
+    }
+    line["phases"] = phases;
+    line["tree_bytes"] = (double)ctx.alloc.tree_bytes;
+    if (count_allocations && ctx.alloc.peak_live_bytes >= 0)
+        line["peak_heap_bytes"] = (double)ctx.alloc.peak_live_bytes;
+    line["posterior_ms"] = ctx.posterior_build_ms;
+    line["search_ms"] = search_ms;
+    line["total_ms"] = total_ms;
+    double sample_ms = 0, tree_ms = 0, nodes = 0, depth = 0, branching = 0, width = 0;
+    int trees = 0, agree = 0, max_nodes = 0, max_depth = 0;
+    map<EncodedCards, pair<double, int> > root;
+    for (const TreeStats &stats : ctx.tree_stats)
+    {
+        if (!stats.done)
+            continue;
+        trees ++;
+        agree += stats.best == action;
+        sample_ms += stats.sample_ms;
+        tree_ms += stats.search_ms;
+        nodes += stats.nodes;
+        depth += stats.mean_depth;
+        branching += stats.branching;
+        width += stats.width;
+        max_nodes = max(max_nodes, stats.nodes);
+        max_depth = max(max_depth, stats.max_depth);
+        for (const pair<EncodedCards, double> &visit : stats.root_visits)
+            root[visit.first].first += visit.second;
+        root[stats.best].second ++;
+    }
+    // 各采样的采样、搜索耗时之和（多线程时大于search_ms）
+    line["sample_ms"] = sample_ms;
+    line["tree_ms"] = tree_ms;
+    // 选出的动作与最终动作相同的树所占的比例
+    line["agreement"] = trees ? double(agree) / trees : 1.0;
+    line["nodes_mean"] = trees ? nodes / trees : 0.0;
+    line["nodes_max"] = max_nodes;
+    line["depth_mean"] = trees ? depth / trees : 0.0;
+    line["depth_max"] = max_depth;
+    line["branching"] = trees ? branching / trees : 0.0;
+    line["width"] = trees ? width / trees : 0.0;
+    vector<pair<double, EncodedCards> > order;
+    for (const auto &entry : root)
+        order.push_back(make_pair(-entry.second.first, entry.first));
+    sort(order.begin(), order.end());
+    Json::Value visits(Json::arrayValue);
+    for (const auto &entry : order)
+    {
+        Json::Value item;
+        item["action"] = cardsName(entry.second);
+        item["visits"] = -entry.first;
+        item["best"] = root[entry.second].second;
+        visits.append(item);
+    }
+    line["root"] = visits;
+    return line;
+}
+
+// 只读地把trace文件映射到内存，直接在映射上遍历记录，不做拷贝
+class TraceReader
+{
+public:
+    TraceReader() : data(NULL), length(0), records(NULL), count(0) {}
+    ~TraceReader()
+    {
+        if (data)
+            munmap(data, length);
+    }
+
+    bool open(const string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(TraceHeader))
+        {
+            close(fd);
+            return false;
+        }
+        length = st.st_size;
+        data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            data = NULL;
+            return false;
+        }
+        const TraceHeader *header = (const TraceHeader *)data;
+        if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 || header->version != TRACE_VERSION ||
+            header->record_size != sizeof(TraceRecord))
+            return false;
+        // 顺序读取，提示内核预读
+        madvise(data, length, MADV_SEQUENTIAL);
+        records = (const TraceRecord *)((const char *)data + sizeof(TraceHeader));
+        // 末尾不完整的记录（写入被中断）忽略
+        count = (length - sizeof(TraceHeader)) / sizeof(TraceRecord);
+        return true;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    const TraceRecord *begin() const
+    {
+        return records;
+    }
+
+    const TraceRecord *end() const
+    {
+        return records + count;
+    }
+
+private:
+    void *data;
+    size_t length;
+    const TraceRecord *records;
+    size_t count;
+};
+
+// 对一个完整的Botzone输入作出决策，返回要输出的JSON。
+// 一局游戏的状态全部保存在局部的GameContext中，因此可以在多个线程中同时调用。
+// record非空时填入本次决策的trace记录（只含本方已知的信息）
+// context不为NULL时在其中做决策，调用者可以事先设置root_prior，事后继续使用其中的后验分布
+Json::Value decide(const Json::Value &input, TraceRecord *record = NULL, doudizhu::GameContext *context = NULL)
 {
     using namespace doudizhu;
+    auto start = chrono::steady_clock::now();
+    GameContext local_ctx;
+    GameContext &ctx = context ? *context : local_ctx;
+    ctx.alloc.begin();
+    ctx.alloc.enter(PHASE_PARSE);
     // 我的牌具体有哪些
     bool my_cards_bm[MAX_CARD_NUM] = {};
     bool player_cards_bm[3][MAX_CARD_NUM] = {};
     // 我的身份
     int pos;
-    Json::Value input;
-    Json::Reader reader;
-    string line;
-    getline(cin, line);
-    reader.parse(line, input);
     // 这对大括号不要删掉
     {
         auto req = input["requests"][0u];
@@ -1142,6 +4102,7 @@ void botzone()
 
     // 看看之前玩家出了什么牌
     auto history = input["requests"][input["requests"].size() - 1]["history"];
+    ctx.root_passes = history[1u].size() > 0 ? 0 : history[0u].size() > 0 ? 1 : 2;
     if (history[1u].size() > 0)
     {
         for (unsigned i = 0; i < history[1u].size(); ++i)
@@ -1159,12 +4120,11 @@ void botzone()
         }
     }
 
-    full_cards = encodedCardsToCardCountVector(FULL_CARDS);
     //从输入中提取出每一次三位玩家的出牌
     auto history_all_turn = input["requests"];
-    turn = history_all_turn.size();
-    player_a = (pos + 1) % 3, player_b = (pos + 2) % 3;
-    for (unsigned i = 0; i < turn; i++)
+    ctx.turn = history_all_turn.size();
+    ctx.player_a = (pos + 1) % 3, ctx.player_b = (pos + 2) % 3;
+    for (unsigned i = 0; i < ctx.turn; i++)
     {
         EncodedCards combo_a = 0, combo_b = 0, combo_c = 0;
         if (i > 0 || pos == 2)
@@ -1172,62 +4132,67 @@ void botzone()
             for (unsigned j = 0; j < history_all_turn[i]["history"][0u].size(); j++)
             {
                 combo_a = addToEncodedCards(CardType(cardTypeOf(history_all_turn[i]["history"][0u][j].asInt())), combo_a, 1);
-                player_cards_bm[player_a][history_all_turn[i]["history"][0u][j].asInt()] = true;
+                player_cards_bm[ctx.player_a][history_all_turn[i]["history"][0u][j].asInt()] = true;
             }
-            history_combo[(pos + 1) % 3].push_back(combo_a);
+            ctx.history_combo[(pos + 1) % 3].push_back(combo_a);
         }
         if (i > 0 || pos >= 1)
         {
             for (unsigned j = 0; j < history_all_turn[i]["history"][1u].size(); j++)
             {
                 combo_b = addToEncodedCards(CardType(cardTypeOf(history_all_turn[i]["history"][1u][j].asInt())), combo_b, 1);
-                player_cards_bm[player_b][history_all_turn[i]["history"][1u][j].asInt()] = true;
+                player_cards_bm[ctx.player_b][history_all_turn[i]["history"][1u][j].asInt()] = true;
             }
-            history_combo[(pos + 2) % 3].push_back(combo_b);
+            ctx.history_combo[(pos + 2) % 3].push_back(combo_b);
         }
-        if (i != turn - 1)
+        if (i != ctx.turn - 1)
         {
             for (unsigned int j = 0; j < input["responses"][i].size(); j++)
             {
                 combo_c = addToEncodedCards(CardType(cardTypeOf(input["responses"][i][j].asInt())), combo_c, 1);
             }
-            history_combo[pos].push_back(combo_c);
+            ctx.history_combo[pos].push_back(combo_c);
         }
     }
     //记录每一轮其他两人的需要压的牌，注意，last_action 在末尾可能会多加一些牌（因为没有判断末尾的边界
-    history_last_action[0].push_back(0);
-    for (unsigned int i = 0; i < turn; i++)
+    ctx.history_last_action[0].push_back(0);
+    for (unsigned int i = 0; i < ctx.turn; i++)
     {
         for (int player = 0; player < 3; player++)
         {
-            int next_player = (player + 1) % 3, last_player = (player - 1) % 3;
-            if (i < history_combo[player].size())
+            int next_player = (player + 1) % 3, last_player = (player + 2) % 3;
+            if (i < ctx.history_combo[player].size())
             {
-                if (history_combo[player][i] > 0)
+                if (ctx.history_combo[player][i] > 0)
                 {
-                    history_last_action[next_player].push_back(history_combo[player][i]);
-                    if (i + (next_player < player) < history_combo[next_player].size() && history_combo[next_player][i + (next_player < player)] == 0)
+                    ctx.history_last_action[next_player].push_back(ctx.history_combo[player][i]);
+                    if (i + (next_player < player) < ctx.history_combo[next_player].size() && ctx.history_combo[next_player][i + (next_player < player)] == 0)
                     {
-                        history_last_action[last_player].push_back(history_combo[player][i]);
+                        ctx.history_last_action[last_player].push_back(ctx.history_combo[player][i]);
                     }
                 }
-                else if (i + (next_player < player) < history_combo[next_player].size() && history_combo[next_player][i + (next_player < player)] == 0)
+                else if (i + (next_player < player) < ctx.history_combo[next_player].size() && ctx.history_combo[next_player][i + (next_player < player)] == 0)
                 {
-                    history_last_action[last_player].push_back(EncodedCards(0));
+                    ctx.history_last_action[last_player].push_back(EncodedCards(0));
                 }
             }
         }
     }
-    for (int i = 0; i < history_combo[player_a].size(); i++)
+    // 用裁判检查对局记录：每一手都应当能压过它当时需要压的牌，不一致时给出警告
+    for (int player = 0; player < 3; player++)
+        for (size_t i = 0; i < ctx.history_combo[player].size() && i < ctx.history_last_action[player].size(); i++)
+            if (!isLegalResponse(ctx.history_combo[player][i], ctx.history_last_action[player][i]))
+                cerr << "inconsistent history: player " << player << " turn " << i << endl;
+    for (int i = 0; i < ctx.history_combo[ctx.player_a].size(); i++)
     {
-        cards_played_a += history_combo[player_a][i];
+        ctx.cards_played_a += ctx.history_combo[ctx.player_a][i];
     }
-    for (int i = 0; i < history_combo[player_b].size(); i++)
+    for (int i = 0; i < ctx.history_combo[ctx.player_b].size(); i++)
     {
-        cards_played_b += history_combo[player_b][i];
+        ctx.cards_played_b += ctx.history_combo[ctx.player_b][i];
     }
-    for(int i = 0; i < history_combo[pos].size(); i++){
-        cards_played_c += history_combo[pos][i];
+    for(int i = 0; i < ctx.history_combo[pos].size(); i++){
+        ctx.cards_played_c += ctx.history_combo[pos][i];
     }
     //处理地主公开牌
     for (int i = 0; i < 3; i++)
@@ -1238,12 +4203,12 @@ void botzone()
     vector<Card> cards_a, cards_b;
     for (int i = 0; i < MAX_CARD_NUM; i++)
     {
-        if (player_cards_bm[player_a][i])
+        if (player_cards_bm[ctx.player_a][i])
             cards_a.push_back(i);
-        if (player_cards_bm[player_b][i])
+        if (player_cards_bm[ctx.player_b][i])
             cards_b.push_back(i);
     }
-    EncodedCards encoded_known_cards_a = toEncodedCards(toCardCountVector(cards_a)), encoded_known_cards_b = toEncodedCards(toCardCountVector(cards_b));
+    EncodedCards encoded_known_cards_a = toEncodedCards(toCardCounter(cards_a)), encoded_known_cards_b = toEncodedCards(toCardCounter(cards_b));
     //记录自己的初始手牌
     auto own = input["requests"][0u]["own"];
     vector<Card> my_initial_cards;
@@ -1251,33 +4216,47 @@ void botzone()
     {
         my_initial_cards.push_back(own[i].asInt());
     }
-    my_initial_cards_counter = toCardCountVector(my_initial_cards);
-    encoded_my_initial_cards = toEncodedCards(my_initial_cards_counter);
+    ctx.my_initial_cards_counter = toCardCounter(my_initial_cards);
+    ctx.encoded_my_initial_cards = toEncodedCards(ctx.my_initial_cards_counter);
     //记录所有目前还不知道在谁手中的牌
-    unknown_cards = encodedCardsToCardCountVector(FULL_CARDS - encoded_known_cards_a - encoded_known_cards_b - encoded_my_initial_cards);
+    ctx.unknown_cards = encodedCardsToCardCounter(FULL_CARDS - encoded_known_cards_a - encoded_known_cards_b - ctx.encoded_my_initial_cards);
 
-    vector<int> known_cards_a = encodedCardsToCardCountVector(encoded_known_cards_a);
-    vector<int> known_cards_b = encodedCardsToCardCountVector(encoded_known_cards_b);
+    CardCounter known_cards_a = encodedCardsToCardCounter(encoded_known_cards_a);
+    EncodedCards encoded_last_action = toEncodedCards(toCardCounter(last_action));
+    ctx.root_last_action = encoded_last_action;
     //遍历所有的初始可能手牌，并计算其后验概率分布的cdf(存储在全局变量cumulative_probability 中)
-    transverseAllHands(START_CARD, known_cards_a, known_cards_b);
-    int tmp = cumulative_probability.size();
-    for (int i = 0; i < tmp; i++)
-        cumulative_probability[i] /= cumulative_probability[tmp - 1];
+    ctx.early_samples.clear();
+    ctx.alloc.enter(PHASE_POSTERIOR);
+    if (pipeline_posterior)
+        pipelinedPosterior(ctx, known_cards_a, encoded_last_action, pos);
+    else
+        buildPosterior(ctx, known_cards_a);
+    // 由后验分布得到两家初始手牌的信念，再按对局记录逐手计入两家打出的牌
+    ctx.beliefs.build(ctx.possible_hands_a, ctx.cumulative_probability, ctx.encoded_my_initial_cards);
+    for (EncodedCards combo : ctx.history_combo[ctx.player_a])
+        if (combo != NO_CARDS)
+            ctx.beliefs.observe(0, combo);
+    for (EncodedCards combo : ctx.history_combo[ctx.player_b])
+        if (combo != NO_CARDS)
+            ctx.beliefs.observe(1, combo);
     /*
         //输出所有可能初始情况和概率
-        for(int i = 0; i < tmp; i++)
-            if (i) cout << cumulative_probability[i] - cumulative_probability[i-1] << " " << hex << (possible_hands_a[i]>>24) << endl;
-            else cout << cumulative_probability[i] << " " << hex << (possible_hands_a[i]>>24) << endl;
+        for(int i = 0; i < ctx.cumulative_probability.size(); i++)
+            if (i) cout << ctx.cumulative_probability[i] - ctx.cumulative_probability[i-1] << " " << hex << (ctx.possible_hands_a[i]>>24) << endl;
+            else cout << ctx.cumulative_probability[i] << " " << hex << (ctx.possible_hands_a[i]>>24) << endl;
     */
     // 根据我现有手牌、待响应的上一手牌，构造当前游戏状态
     DoudizhuState state(my_cards, last_action);
-
-    // 根据当前游戏状态，生成全部可行动作，用EncodedCards编码
-    vector<EncodedCards> valid_actions = state.validActions();
     // 随机选择得到的动作，用牌张列表表示（0-53编码）
     vector<Card> action;
     
-    action = state.decodeAction(DetMCTS (toEncodedCards(toCardCountVector(last_action)), pos));
+    ctx.collect_telemetry = telemetry_writer.enabled();
+    auto search_start = chrono::steady_clock::now();
+    ctx.alloc.enter(PHASE_SEARCH);
+    EncodedCards encoded_action = DetMCTS (ctx, encoded_last_action, pos);
+    double search_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - search_start).count();
+    ctx.alloc.enter(PHASE_TEARDOWN);
+    action = state.decodeAction(encoded_action);
 /*
     // 随机选择得到的动作在所有可行动作中的序号
     unsigned random_action_id;
@@ -1306,16 +4285,1051 @@ void botzone()
         response.append(c);
     }
     result["response"] = response;
+    // 对局编号取初始手牌的FNV-1a散列
+    uint32_t game = 2166136261u;
+    for (Card c : my_initial_cards)
+        game = (game ^ uint32_t(c)) * 16777619u;
+    int ply = 3 * (ctx.turn - 1) + pos;
+    if (record)
+    {
+        memset(record, 0, sizeof(TraceRecord));
+        record->game = game;
+        record->ply = ply;
+        record->seat = pos;
+        record->initial_hands[pos] = ctx.encoded_my_initial_cards;
+        record->last_action = encoded_last_action;
+        record->action = encoded_action;
+        record->samples = ctx.search_samples;
+        record->peak_nodes = ctx.search_peak_nodes;
+        record->posterior_kept = ctx.posterior_kept;
+        record->decision_us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    }
+    // 本次决策自己的上下文用完了，释放后验分布的缓冲；调用者传入的上下文留给调用者
+    if (!context)
+    {
+        vector<EncodedCards>().swap(ctx.possible_hands_a);
+        vector<double>().swap(ctx.cumulative_probability);
+    }
+    ctx.alloc.end();
+    if (telemetry_writer.enabled())
+    {
+        Json::Value line = searchTelemetry(ctx, encoded_action, search_ms,
+                                           chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        line["game"] = game;
+        line["ply"] = ply;
+        line["seat"] = pos;
+        telemetry_writer.write(line);
+    }
+    // 记录种子，使用 --seed 参数和相同的输入即可复现本次决策
+    string debug = "seed=" + to_string(search_seed) +
+                   " posterior=" + to_string(ctx.posterior_kept) + "/" + to_string(ctx.posterior_enumerated) +
+                   " posterior_ms=" + to_string(int(ctx.posterior_build_ms)) +
+                   " samples=" + to_string(ctx.search_samples) +
+                   " dets=" + to_string(ctx.search_determinizations) +
+                   " ponder=" + to_string(ctx.root_prior ? ctx.prior_samples : 0) +
+                   " early=" + to_string(ctx.early_samples.size()) +
+                   " peak_nodes=" + to_string(ctx.search_peak_nodes) +
+                   " rss_kb=" + to_string(peakRssKB()) +
+                   " action_cache=" + to_string(action_cache_hits.load()) + "/" + to_string(action_cache_lookups.load());
+    // 各阶段（解析/后验/抽样/搜索/收尾）的耗时和分配次数，以及搜索树和存活堆峰值的内存
+    string phase_ms, phase_allocs;
+    for (int p = PHASE_PARSE; p < PHASE_NUM; p++)
+    {
+        phase_ms += (p > PHASE_PARSE ? "/" : "") + to_string(int(ctx.alloc.ms[p]));
+        phase_allocs += (p > PHASE_PARSE ? "/" : "") + to_string(ctx.alloc.allocs[p]);
+    }
+    debug += " phase_ms=" + phase_ms + " tree_kb=" + to_string(ctx.alloc.tree_bytes >> 10);
+    if (count_allocations)
+        debug += " allocs=" + phase_allocs;
+    if (count_allocations && ctx.alloc.peak_live_bytes >= 0)
+        debug += " heap_peak_kb=" + to_string(ctx.alloc.peak_live_bytes >> 10);
+    result["debug"] = debug;
+    return result;
+}
+
+Json::Value toJsonCards(const vector<doudizhu::Card> &cards)
+{
+    Json::Value array(Json::arrayValue);
+    for (doudizhu::Card c : cards)
+        array.append(c);
+    return array;
+}
+
+// 牌张列表（0-53编码）转为按点数计数的编码，不是数组时视为pass
+doudizhu::EncodedCards fromJsonCards(const Json::Value &array)
+{
+    using namespace doudizhu;
+    vector<Card> cards;
+    if (array.isArray())
+        for (unsigned i = 0; i < array.size(); i++)
+            cards.push_back(array[i].asInt());
+    return toEncodedCards(toCardCounter(cards));
+}
+
+void botzone()
+{
+    Json::Value input;
+    Json::Reader reader;
+    string line;
+    getline(cin, line);
+    reader.parse(line, input);
+    Json::FastWriter writer;
+    TraceRecord record;
+    cout << writer.write(decide(input, &record)) << endl;
+    trace_writer.write(&record, 1);
+}
+
+// Botzone长时运行模式：第一回合读入完整的输入，之后每回合只读入本回合的request，
+// 由程序自己记录历史。每次输出后请求平台保持程序运行；开启--ponder时在等待期间预想
+void keepRunning()
+{
+    using namespace doudizhu;
+    Json::Value input;
+    Json::Reader reader;
+    Json::FastWriter writer;
+    Ponderer ponderer;
+    string line;
+    while (getline(cin, line))
+    {
+        Json::Value message;
+        if (!reader.parse(line, message) || !message.isObject())
+            continue;
+        ponderer.stop();
+        unique_ptr<GameContext> ctx(new GameContext);
+        if (message.isMember("requests"))
+            input = message;
+        else
+        {
+            input["requests"].append(message);
+            // history[0]为下家、history[1]为上家在我上次出牌之后出的牌
+            ctx->root_prior = ponderer.prior(fromJsonCards(message["history"][0u]), fromJsonCards(message["history"][1u]));
+            ctx->prior_samples = ponderer.sampleCount();
+        }
+        TraceRecord record;
+        Json::Value output = decide(input, &record, ctx.get());
+        input["responses"].append(output["response"]);
+        cout << writer.write(output) << ">>>BOTZONE_REQUEST_KEEP_RUNNING<<<" << endl;
+        trace_writer.write(&record, 1);
+
+        EncodedCards action = fromJsonCards(output["response"]);
+        ctx->cards_played_c += action;
+        ctx->root_prior = NULL;
+        if (!ponder || ctx->cards_played_c == ctx->encoded_my_initial_cards)
+            continue;
+        // 下家面对的局面：我出了牌则要压我的牌；我pass时连续两家pass则下家自由出牌
+        int passes = isPass(action) ? ctx->root_passes + 1 : 0;
+        EncodedCards last = isPass(action) ? (passes < 2 ? ctx->root_last_action : NO_CARDS) : action;
+        int pos = (ctx->player_a + 2) % 3;
+        ponderer.start(move(ctx), pos, last, passes);
+    }
+}
+
+// 批量服务模式：从标准输入逐行读入请求（每行一个完整的Botzone JSON输入），
+// 在线程池上并发处理，按输入顺序每行输出一个结果。每次读入一批，处理完一批输出一批
+void serve()
+{
+    using namespace doudizhu;
+    ThreadPool &pool = threadPool();
+    const size_t chunk_size = pool.size() * 16;
+    vector<string> lines, outputs;
+    string line;
+    while (true)
+    {
+        lines.clear();
+        while (lines.size() < chunk_size && getline(cin, line))
+        {
+            if (!line.empty())
+                lines.push_back(line);
+        }
+        if (lines.empty())
+            break;
+        outputs.assign(lines.size(), string());
+        pool.parallelFor(lines.size(), [&](int i, int)
+        {
+            Json::Value input;
+            Json::Reader reader;
+            Json::FastWriter writer;
+            TraceRecord record;
+            if (reader.parse(lines[i], input))
+            {
+                outputs[i] = writer.write(decide(input, &record));
+                trace_writer.write(&record, 1);
+            }
+            else
+                outputs[i] = "{\"error\":\"invalid request\"}\n";
+        });
+        for (const string &output : outputs)
+            cout << output;
+        cout.flush();
+    }
+}
+
+// 基准测试的参数：局面数、参考搜索的采样数，以及逗号分隔的时间预算（毫秒）和线程数列表
+int bench_positions = 50;
+int bench_reference_samples = 1000;
+string bench_budgets = "1,2,5,10,20,50";
+string bench_threads = "1,2,4";
+
+vector<double> parseList(const string &s)
+{
+    vector<double> values;
+    const char *p = s.c_str();
+    char *end;
+    while (*p)
+    {
+        double v = strtod(p, &end);
+        if (end == p)
+            break;
+        values.push_back(v);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return values;
+}
+
+// 本地对局：发一副牌，按Botzone的输入格式为三家分别记录requests和responses
+struct LocalGame
+{
+    vector<doudizhu::Card> hands[3], public_cards;
+    // prev[1]是上一手，prev[0]是再上一手
+    vector<doudizhu::Card> prev[2];
+    Json::Value inputs[3];
+    int ply, cur;
+
+    explicit LocalGame(doudizhu::Rng &rng) : ply(0), cur(0)
+    {
+        using namespace doudizhu;
+        vector<Card> deck;
+        for (Card c = START_CARD << 2; c < MAX_CARD_NUM; c++)
+            deck.push_back(c);
+        rng.shuffle(deck.begin(), deck.end());
+        // 地主12张（其中3张公开），两个农民各9张
+        hands[0].assign(deck.begin(), deck.begin() + 12);
+        hands[1].assign(deck.begin() + 12, deck.begin() + 21);
+        hands[2].assign(deck.begin() + 21, deck.end());
+        for (vector<Card> &hand : hands)
+            sort(hand.begin(), hand.end());
+        public_cards.assign(hands[0].begin(), hands[0].begin() + 3);
+        for (Json::Value &input : inputs)
+        {
+            input["requests"] = Json::Value(Json::arrayValue);
+            input["responses"] = Json::Value(Json::arrayValue);
+        }
+    }
+
+    // 当前玩家需要压的牌，为空表示可以任意出
+    const vector<doudizhu::Card> &lastAction() const
+    {
+        return prev[1].empty() ? prev[0] : prev[1];
+    }
+
+    // 为当前玩家追加本轮的request，返回他看到的完整输入
+    const Json::Value &request()
+    {
+        Json::Value request;
+        request["history"] = Json::Value(Json::arrayValue);
+        request["history"].append(toJsonCards(prev[0]));
+        request["history"].append(toJsonCards(prev[1]));
+        if (ply < 3)
+        {
+            request["own"] = toJsonCards(hands[cur]);
+            request["publiccard"] = toJsonCards(public_cards);
+        }
+        inputs[cur]["requests"].append(request);
+        return inputs[cur];
+    }
+
+    // 当前玩家打出action并轮到下一家，返回他是否已经出完。不合法的动作由裁判报告
+    bool play(const vector<doudizhu::Card> &action)
+    {
+        using namespace doudizhu;
+        if (!isLegalPlay(toEncodedCards(toCardCounter(hands[cur])), toEncodedCards(toCardCounter(action)), toEncodedCards(toCardCounter(lastAction()))))
+            cerr << "illegal move by seat " << cur << " at ply " << ply << endl;
+        for (doudizhu::Card c : action)
+            hands[cur].erase(find(hands[cur].begin(), hands[cur].end(), c));
+        inputs[cur]["responses"].append(toJsonCards(action));
+        prev[0] = prev[1];
+        prev[1] = action;
+        if (hands[cur].empty())
+            return true;
+        ply++;
+        cur = (cur + 1) % 3;
+        return false;
+    }
+};
+
+// 三家随机出牌plies手后，返回轮到出牌的一方看到的Botzone输入。
+// 如果中途有人这一手能出完，就停在这个局面
+Json::Value benchPosition(doudizhu::Rng &rng, int plies)
+{
+    using namespace doudizhu;
+    LocalGame game(rng);
+    while (true)
+    {
+        const Json::Value &input = game.request();
+        DoudizhuState state(game.hands[game.cur], game.lastAction());
+        vector<EncodedCards> actions = state.validActions();
+        EncodedCards choice = actions[rng.nextBounded(actions.size())];
+        if (game.ply >= plies || choice == toEncodedCards(state.my_card_counter))
+            return input;
+        game.play(state.decodeAction(choice));
+    }
+}
+
+// 强度-时间曲线：先用不限时间、bench_reference_samples次采样的搜索为每个局面给出参考动作，
+// 再对每个(线程数, 时间预算)组合重新决策，输出与参考动作的一致率和决策延迟（CSV）。
+// 延迟包含构造后验分布的时间，时间预算只限制搜索阶段
+// 基准测试用的bench_positions个局面，只依赖于search_seed
+vector<Json::Value> benchPositions()
+{
+    using namespace doudizhu;
+    Rng rng(search_seed);
+    vector<Json::Value> positions;
+    for (int i = 0; i < bench_positions; i++)
+    {
+        Rng deal = rng.stream(i);
+        positions.push_back(benchPosition(deal, deal.nextBounded(18)));
+    }
+    return positions;
+}
+
+void bench()
+{
+    using namespace doudizhu;
+    vector<double> budgets = parseList(bench_budgets), threads = parseList(bench_threads);
+    vector<Json::Value> positions = benchPositions();
+
+    // 搜索结果与线程数无关，参考搜索用最多的线程数来算
+    det_samples = bench_reference_samples;
+    time_budget_ms = 0;
+    thread_num = threads.empty() ? 1 : max(1, int(*max_element(threads.begin(), threads.end())));
+    vector<EncodedCards> reference;
+    for (const Json::Value &position : positions)
+    {
+        reference.push_back(fromJsonCards(decide(position)["response"]));
+    }
+
+    cout << "threads,budget_ms,positions,agreement,mean_ms,p50_ms,p95_ms,max_ms,mean_samples" << endl;
+    for (double t : threads)
+    {
+        for (double budget : budgets)
+        {
+            thread_num = max(1, int(t));
+            time_budget_ms = budget;
+            vector<double> latency;
+            int agree = 0;
+            long long samples = 0;
+            for (unsigned i = 0; i < positions.size(); i++)
+            {
+                TraceRecord record;
+                auto start = chrono::steady_clock::now();
+                Json::Value response = decide(positions[i], &record)["response"];
+                latency.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+                agree += fromJsonCards(response) == reference[i];
+                samples += record.samples;
+            }
+            if (latency.empty())
+                continue;
+            vector<double> sorted = latency;
+            sort(sorted.begin(), sorted.end());
+            double total = 0;
+            for (double ms : latency)
+                total += ms;
+            int count = latency.size();
+            printf("%d,%g,%d,%.4f,%.3f,%.3f,%.3f,%.3f,%.1f\n", thread_num, budget, count, double(agree) / count,
+                   total / count, sorted[count / 2], sorted[min(count - 1, count * 95 / 100)], sorted.back(),
+                   double(samples) / count);
+            fflush(stdout);
+        }
+    }
+}
+
+// 回放模式的对照程序（可带参数），以Botzone模式运行，每个决策点启动一次；为空时只与日志中记录的动作比较
+string replay_baseline;
+
+// 回放中的一个决策点：日志文件、座位、该座位的第几次决策、botzone()读入的一行输入，以及日志中记录的动作
+struct ReplayDecision
+{
+    string file;
+    int seat, turn;
+    string input;
+    Json::Value logged;
+    // 回放结果
+    Json::Value response, baseline;
+    double ms, baseline_ms;
+};
+
+// 读入一份Botzone对局日志（下载的整局记录，或其中的log数组），按botzone()看到的形式重建每个决策点的输入：
+// 裁判的输出中content按玩家编号给出请求，下一条记录按玩家编号给出回应
+bool loadMatchLog(const string &path, vector<ReplayDecision> &decisions)
+{
+    ifstream in(path.c_str());
+    Json::Value root;
+    Json::Reader reader;
+    if (!in || !reader.parse(in, root))
+        return false;
+    const Json::Value &log = root.isObject() ? root["log"] : root;
+    if (!log.isArray())
+        return false;
     Json::FastWriter writer;
-    cout << writer.write(result) << endl;
+    Json::Value requests[3], responses[3];
+    int pending[3] = {-1, -1, -1};
+    for (int p = 0; p < 3; p++)
+    {
+        requests[p] = Json::Value(Json::arrayValue);
+        responses[p] = Json::Value(Json::arrayValue);
+    }
+    for (unsigned i = 0; i < log.size(); i++)
+    {
+        const Json::Value &entry = log[i];
+        if (!entry.isObject())
+            continue;
+        bool judge = entry.isMember("output");
+        // 裁判的输出中只有command为request的是请求，对局结束时的finish给出的是得分
+        if (judge && (!entry["output"].isObject() || entry["output"]["command"].asString() != "request"))
+            continue;
+        const Json::Value &content = judge ? entry["output"]["content"] : entry;
+        if (!content.isObject())
+            continue;
+        for (int p = 0; p < 3; p++)
+        {
+            string id = to_string(p);
+            if (!content.isMember(id))
+                continue;
+            if (judge)
+            {
+                requests[p].append(content[id]);
+                Json::Value input;
+                input["requests"] = requests[p];
+                input["responses"] = responses[p];
+                ReplayDecision d;
+                d.file = path;
+                d.seat = p;
+                d.turn = requests[p].size() - 1;
+                d.input = writer.write(input);
+                d.ms = d.baseline_ms = 0;
+                pending[p] = decisions.size();
+                decisions.push_back(d);
+            }
+            else if (pending[p] != -1)
+            {
+                Json::Value response = content[id].isObject() ? content[id]["response"] : content[id];
+                // 程序输出的是{"response": ...}时，平台可能原样记录
+                if (response.isObject() && response.isMember("response"))
+                    response = response["response"];
+                responses[p].append(response);
+                decisions[pending[p]].logged = response;
+                pending[p] = -1;
+            }
+        }
+    }
+    return true;
+}
+
+// 以Botzone模式运行基线程序做一次决策，输入经临时文件传入，output为其输出的最后一行
+bool runBaseline(const string &input, Json::Value &output, double &ms)
+{
+    char path[] = "/tmp/ddzreplayXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, input.data(), input.size()) == (ssize_t)input.size();
+    close(fd);
+    string text, last;
+    if (ok)
+    {
+        auto start = chrono::steady_clock::now();
+        FILE *pipe = popen((replay_baseline + " < " + path + " 2>/dev/null").c_str(), "r");
+        if (pipe)
+        {
+            char buffer[4096];
+            size_t n;
+            while ((n = fread(buffer, 1, sizeof(buffer), pipe)) > 0)
+                text.append(buffer, n);
+            ok = pclose(pipe) == 0;
+        }
+        else
+            ok = false;
+        ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+    unlink(path);
+    size_t begin = 0;
+    while (begin < text.size())
+    {
+        size_t end = text.find('\n', begin);
+        if (end == string::npos)
+            end = text.size();
+        if (end > begin)
+            last = text.substr(begin, end - begin);
+        begin = end + 1;
+    }
+    Json::Reader reader;
+    return ok && reader.parse(last, output);
+}
+
+// 回放目录中所有Botzone对局日志的每个决策点，在线程池上并发重新决策。
+// 标准输出逐个决策点输出CSV，标准错误输出吞吐量、延迟分位数，以及与日志、基线程序相比改变了的决策数
+void replay(const string &dir)
+{
+    using namespace doudizhu;
+    vector<string> files;
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+    {
+        cerr << "failed to open replay directory " << dir << endl;
+        return;
+    }
+    while (dirent *entry = readdir(d))
+        if (entry->d_name[0] != '.')
+            files.push_back(dir + "/" + entry->d_name);
+    closedir(d);
+    sort(files.begin(), files.end());
+    vector<ReplayDecision> decisions;
+    int logs = 0;
+    for (const string &file : files)
+    {
+        if (loadMatchLog(file, decisions))
+            logs ++;
+        else
+            cerr << "skipping " << file << ": not a Botzone match log" << endl;
+    }
+
+    ThreadPool &pool = threadPool();
+    auto start = chrono::steady_clock::now();
+    pool.parallelFor(decisions.size(), [&](int i, int)
+    {
+        ReplayDecision &decision = decisions[i];
+        Json::Value input;
+        Json::Reader reader;
+        reader.parse(decision.input, input);
+        TraceRecord record;
+        auto begin = chrono::steady_clock::now();
+        decision.response = decide(input, &record)["response"];
+        decision.ms = chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+        trace_writer.write(&record, 1);
+        Json::Value output;
+        if (!replay_baseline.empty() && runBaseline(decision.input, output, decision.baseline_ms))
+            decision.baseline = output["response"];
+    });
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "file,seat,turn,ms,response,changed_vs_log,baseline_ms,changed_vs_baseline" << endl;
+    vector<double> latency;
+    int logged = 0, changed_log = 0, baselines = 0, changed_baseline = 0;
+    double baseline_total = 0;
+    for (const ReplayDecision &decision : decisions)
+    {
+        string cards;
+        for (unsigned j = 0; j < decision.response.size(); j++)
+            cards += (j ? " " : "") + to_string(decision.response[j].asInt());
+        EncodedCards action = fromJsonCards(decision.response);
+        bool has_log = decision.logged.isArray(), has_baseline = decision.baseline.isArray();
+        bool diff_log = has_log && fromJsonCards(decision.logged) != action;
+        bool diff_baseline = has_baseline && fromJsonCards(decision.baseline) != action;
+        logged += has_log;
+        changed_log += diff_log;
+        baselines += has_baseline;
+        changed_baseline += diff_baseline;
+        if (has_baseline)
+            baseline_total += decision.baseline_ms;
+        latency.push_back(decision.ms);
+        printf("%s,%d,%d,%.3f,%s,%s,", decision.file.c_str(), decision.seat, decision.turn, decision.ms, cards.c_str(),
+               has_log ? (diff_log ? "1" : "0") : "");
+        if (has_baseline)
+            printf("%.3f,%d\n", decision.baseline_ms, diff_baseline);
+        else
+            printf(",\n");
+    }
+    fflush(stdout);
+    if (latency.empty())
+    {
+        cerr << "no decisions to replay" << endl;
+        return;
+    }
+    sort(latency.begin(), latency.end());
+    double total = 0;
+    for (double ms : latency)
+        total += ms;
+    int count = latency.size();
+    fprintf(stderr, "replayed %d decisions from %d logs in %.3f s on %d threads: %.1f decisions/s\n",
+            count, logs, wall, pool.size(), count / max(wall, 1e-9));
+    fprintf(stderr, "latency ms: mean %.3f p50 %.3f p95 %.3f max %.3f\n", total / count,
+            latency[count / 2], latency[min(count - 1, count * 95 / 100)], latency.back());
+    fprintf(stderr, "changed vs log: %d/%d\n", changed_log, logged);
+    if (!replay_baseline.empty())
+        fprintf(stderr, "changed vs baseline: %d/%d (baseline mean %.3f ms per decision, including process start)\n",
+                changed_baseline, baselines, baselines ? baseline_total / baselines : 0.0);
+}
+
+// 搜索热路径的堆分配：对每个基准局面构造后验分布后，用同一棵树依次做det_samples次采样搜索，
+// 只统计UCTSearch内的分配。每个局面搜索两遍：第一遍动作缓存逐渐填充（冷），
+// 第二遍重复同样的采样（热），此时剩下的只可能是搜索本身的分配，应当为0。
+// 之后按阶段输出每次决策的平均耗时和分配，作为减少分配的改动的基准（字节数需要以-DALLOC_STATS编译）
+void benchAllocations()
+{
+    using namespace doudizhu;
+    vector<Json::Value> positions = benchPositions();
+    MCTree tree;
+    long long iterations = 0, cold = 0, warm = 0;
+    double warm_ms = 0;
+    AllocReport total;
+    long long peak_heap = -1, tree_bytes = 0;
+    for (const Json::Value &position : positions)
+    {
+        GameContext ctx;
+        decide(position, NULL, &ctx);
+        for (int p = 0; p < PHASE_NUM; p++)
+        {
+            total.ms[p] += ctx.alloc.ms[p];
+            total.allocs[p] += ctx.alloc.allocs[p];
+            total.frees[p] += ctx.alloc.frees[p];
+            total.bytes[p] += ctx.alloc.bytes[p];
+        }
+        peak_heap = max(peak_heap, ctx.alloc.peak_live_bytes);
+        tree_bytes = max(tree_bytes, ctx.alloc.tree_bytes);
+        int pos = (ctx.player_a + 2) % 3;
+        Rng rng = Rng(search_seed).stream(~0ull);
+        for (int pass = 0; pass < 2; pass++)
+        {
+            // 与按阶段的统计一样只计本线程的分配：采样计入PHASE_SAMPLING，UCTSearch计入PHASE_SEARCH
+            AllocReport report;
+            report.begin();
+            auto start = chrono::steady_clock::now();
+            for (int T = 0; T < det_samples; T++)
+            {
+                Rng sample_rng = rng.stream(T);
+                report.enter(PHASE_SAMPLING);
+                PlayerHands init_state = sample (ctx, sample_rng);
+                report.enter(PHASE_SEARCH);
+                UCTSearch (tree, init_state, ctx.root_last_action, pos, ctx.root_passes, sample_rng.stream(0));
+            }
+            if (pass)
+                warm_ms += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            report.end();
+            (pass ? warm : cold) += report.allocs[PHASE_SEARCH];
+        }
+        iterations += (long long)det_samples * uct_iterations;
+    }
+    cout << "positions,iterations,cold_allocs_per_iteration,warm_allocs_per_iteration,warm_ns_per_iteration" << endl;
+    printf("%d,%lld,%.4f,%.4f,%.1f\n", (int)positions.size(), iterations, double(cold) / iterations,
+           double(warm) / iterations, warm_ms * 1e6 / iterations);
+    int n = positions.size();
+    // 不以-DALLOC_STATS编译时释放次数、字节数和存活堆峰值没有统计，输出n/a而不是0
+    cout << "phase,ms_per_decision,allocs_per_decision,frees_per_decision,bytes_per_decision" << endl;
+    for (int p = PHASE_PARSE; p < PHASE_NUM; p++)
+    {
+        printf("%s,%.3f,%.1f,", PHASE_NAMES[p], total.ms[p] / n, double(total.allocs[p]) / n);
+        if (ALLOC_BYTES_TRACKED)
+            printf("%.1f,%.0f\n", double(total.frees[p]) / n, double(total.bytes[p]) / n);
+        else
+            printf("n/a,n/a\n");
+    }
+    cout << "max_peak_heap_bytes,max_tree_bytes" << endl;
+    if (peak_heap >= 0)
+        printf("%lld,%lld\n", peak_heap, tree_bytes);
+    else
+        printf("n/a,%lld\n", tree_bytes);
+}
+
+// 估值模型训练的参数：自我对局局数、隐层宽度、训练轮数、学习率，以及模型输出的量级（与启发式估值相当）
+int train_games = 200;
+int train_hidden = 32;
+int train_epochs = 30;
+double train_rate = 0.01;
+double train_scale = 100;
+
+struct ValueSample
+{
+    int8_t x[doudizhu::VALUE_FEATURES];
+    float y;
+};
+
+// 自我对局一局，局号为game_id。每一手都通过decide决策，记录中补上三家的初始手牌和最终胜负
+void selfPlay(doudizhu::Rng &rng, uint32_t game_id, vector<TraceRecord> &records)
+{
+    using namespace doudizhu;
+    LocalGame game(rng);
+    EncodedCards initial_hands[3];
+    for (int k = 0; k < 3; k++)
+        initial_hands[k] = toEncodedCards(toCardCounter(game.hands[k]));
+    size_t first = records.size();
+    while (true)
+    {
+        TraceRecord record;
+        Json::Value response = decide(game.request(), &record)["response"];
+        record.game = game_id;
+        record.ply = game.ply;
+        record.flags = TRACE_HANDS_KNOWN;
+        copy(initial_hands, initial_hands + 3, record.initial_hands);
+        records.push_back(record);
+        vector<Card> action;
+        for (unsigned i = 0; i < response.size(); i++)
+            action.push_back(response[i].asInt());
+        if (game.play(action))
+            break;
+    }
+    uint8_t result = game.cur == 0 ? TRACE_LANDLORD_WON : TRACE_FARMERS_WON;
+    for (size_t i = first; i < records.size(); i++)
+        records[i].flags |= result;
+}
+
+// 从trace记录依次还原每一步的局面，按当前玩家的视角生成估值模型的训练样本（与defaultPolicy中的叶节点相同），
+// 以当前玩家一方是否获胜标注为±1。只使用三家手牌和胜负都已知的记录
+void appendValueSamples(const TraceRecord *begin, const TraceRecord *end, vector<ValueSample> &samples)
+{
+    using namespace doudizhu;
+    EncodedCards hands[3] = {};
+    uint32_t game = 0;
+    for (const TraceRecord *r = begin; r != end; r++)
+    {
+        if (!(r->flags & TRACE_HANDS_KNOWN) || !(r->flags & (TRACE_LANDLORD_WON | TRACE_FARMERS_WON)))
+            continue;
+        if (r->ply == 0 || r->game != game)
+        {
+            copy(r->initial_hands, r->initial_hands + 3, hands);
+            game = r->game;
+        }
+        ValueSample sample;
+        valueFeatures(hands[r->seat], hands[(r->seat + 1) % 3], hands[(r->seat + 2) % 3], r->last_action, r->seat, sample.x);
+        sample.y = (r->seat == 0) == bool(r->flags & TRACE_LANDLORD_WON) ? 1 : -1;
+        samples.push_back(sample);
+        hands[r->seat] = playCard(hands[r->seat], r->action);
+    }
+}
+
+// 自我对局n局，每局的记录写入trace文件，局号为对局的随机数流编号
+void selfPlayGames(int n, vector<TraceRecord> *records = NULL)
+{
+    using namespace doudizhu;
+    Rng rng(search_seed);
+    vector<TraceRecord> game_records;
+    for (int g = 0; g < n; g++)
+    {
+        Rng deal = rng.stream(g);
+        game_records.clear();
+        selfPlay(deal, g, game_records);
+        trace_writer.write(game_records.data(), game_records.size());
+        if (records)
+            records->insert(records->end(), game_records.begin(), game_records.end());
+        if ((g + 1) % 10 == 0)
+            cerr << "self-play " << g + 1 << "/" << n << " games" << endl;
+    }
+}
+
+// 用同步批量模拟以贪心策略自我对局n局：同一组牌局先用AVX2、再用标量实现各模拟一遍，检查两者结果相同并报告各自的速度。
+// 打开了trace时把每一手写入trace，可以作为训练估值模型的大量数据
+void simulateSelfPlay(int n)
+{
+    using namespace doudizhu;
+    Rng rng(search_seed);
+    vector<EncodedCards> hands(3 * n), last(n, NO_CARDS);
+    vector<int> cur(n, 0), last_player(n, 0);
+    for (int g = 0; g < n; g++)
+    {
+        Rng deal = rng.stream(g);
+        LocalGame game(deal);
+        for (int k = 0; k < 3; k++)
+            hands[3 * g + k] = toEncodedCards(toCardCounter(game.hands[k]));
+    }
+    simTables();
+    vector<int> winners[2];
+    vector<SimMove> moves;
+    double ms[2];
+    bool use_avx2 = sim_use_avx2;
+    for (int run = 0; run < 2; run++)
+    {
+        sim_use_avx2 = run == 0 && use_avx2;
+        winners[run].assign(n, -1);
+        auto start = chrono::steady_clock::now();
+        simulateGames(hands.data(), cur.data(), last.data(), last_player.data(), 0, n, winners[run].data(),
+                      run == 0 && trace_writer.enabled() ? &moves : NULL);
+        ms[run] = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+    sim_use_avx2 = use_avx2;
+    if (!moves.empty())
+    {
+        vector<TraceRecord> records(moves.size());
+        for (size_t i = 0; i < moves.size(); i++)
+        {
+            const SimMove &move = moves[i];
+            TraceRecord &record = records[i];
+            memset(&record, 0, sizeof(TraceRecord));
+            record.game = move.game;
+            record.ply = move.ply;
+            record.seat = move.player;
+            record.flags = TRACE_HANDS_KNOWN | (winners[0][move.game] == 0 ? TRACE_LANDLORD_WON : TRACE_FARMERS_WON);
+            copy(hands.begin() + 3 * move.game, hands.begin() + 3 * move.game + 3, record.initial_hands);
+            record.last_action = move.last;
+            record.action = move.action;
+        }
+        // 模拟按步交错记录各局，trace中同一局的记录需要连续
+        stable_sort(records.begin(), records.end(), [](const TraceRecord &a, const TraceRecord &b) { return a.game < b.game; });
+        trace_writer.write(records.data(), records.size());
+    }
+    int landlord_wins = count(winners[0].begin(), winners[0].end(), 0);
+    cout << "games=" << n << " lanes=" << SIM_LANES << " landlord_win=" << double(landlord_wins) / n
+         << " lockstep_games_per_s=" << int(n / ms[0] * 1000) << " scalar_games_per_s=" << int(n / ms[1] * 1000)
+         << " speedup=" << ms[1] / ms[0] << (winners[0] == winners[1] ? "" : " MISMATCH") << endl;
+}
+
+// 离线训练估值模型（浮点SGD，均方误差），写入path。训练数据来自trace_path给出的trace文件，
+// 为空时先用当前的搜索设置自我对局train_games局。量化在加载时进行，训练得到的是浮点权重
+void trainValue(const string &path, const string &trace_path)
+{
+    using namespace doudizhu;
+    const int F = VALUE_FEATURES, H = train_hidden;
+    Rng rng(search_seed);
+    vector<ValueSample> samples;
+    if (trace_path.empty())
+    {
+        vector<TraceRecord> records;
+        selfPlayGames(train_games, &records);
+        appendValueSamples(records.data(), records.data() + records.size(), samples);
+    }
+    else
+    {
+        TraceReader reader;
+        if (!reader.open(trace_path))
+        {
+            cerr << "failed to read trace " << trace_path << endl;
+            return;
+        }
+        appendValueSamples(reader.begin(), reader.end(), samples);
+    }
+    cerr << samples.size() << " training positions" << endl;
+
+    Rng init = rng.stream(train_games);
+    vector<float> w1(H * F), b1(H), w2(H ? H : F), h(H), pre(H);
+    float b2 = 0;
+    for (float &w : w1)
+        w = float((init.nextDouble() * 2 - 1) * sqrt(6.0 / F));
+    for (float &w : w2)
+        w = float((init.nextDouble() * 2 - 1) * 0.1);
+    vector<int> order(samples.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    for (int epoch = 0; epoch < train_epochs; epoch++)
+    {
+        init.shuffle(order.begin(), order.end());
+        double loss = 0;
+        int correct = 0;
+        for (int id : order)
+        {
+            const ValueSample &sample = samples[id];
+            float z = b2;
+            if (H == 0)
+                for (int i = 0; i < F; i++)
+                    z += w2[i] * sample.x[i];
+            for (int j = 0; j < H; j++)
+            {
+                pre[j] = b1[j];
+                for (int i = 0; i < F; i++)
+                    pre[j] += w1[j * F + i] * sample.x[i];
+                h[j] = max(0.0f, pre[j]);
+                z += w2[j] * h[j];
+            }
+            float t = tanh(z), err = t - sample.y, g = err * (1 - t * t);
+            loss += err * err;
+            correct += (t > 0) == (sample.y > 0);
+            if (H == 0)
+                for (int i = 0; i < F; i++)
+                    w2[i] -= train_rate * g * sample.x[i];
+            for (int j = 0; j < H; j++)
+            {
+                float gh = pre[j] > 0 ? g * w2[j] : 0;
+                w2[j] -= train_rate * g * h[j];
+                if (gh == 0)
+                    continue;
+                b1[j] -= train_rate * gh;
+                for (int i = 0; i < F; i++)
+                    w1[j * F + i] -= train_rate * gh * sample.x[i];
+            }
+            b2 -= train_rate * g;
+        }
+        cerr << "epoch " << epoch + 1 << " mse=" << loss / max<size_t>(1, samples.size())
+             << " accuracy=" << double(correct) / max<size_t>(1, samples.size()) << endl;
+    }
+
+    ofstream out(path.c_str());
+    out << "value-model " << H << " " << train_scale << "\n";
+    for (int j = 0; j < H; j++)
+    {
+        for (int i = 0; i < F; i++)
+            out << w1[j * F + i] << (i + 1 < F ? " " : "\n");
+    }
+    for (float v : b1)
+        out << v << " ";
+    out << "\n";
+    for (float v : w2)
+        out << v << " ";
+    out << "\n" << b2 << "\n";
+}
+
+// 统计trace文件：记录数、对局数、各座位的决策数、平均采样数和决策耗时，以及遍历的速度
+void traceStats(const string &path)
+{
+    TraceReader reader;
+    if (!reader.open(path))
+    {
+        cerr << "failed to read trace " << path << endl;
+        return;
+    }
+    auto start = chrono::steady_clock::now();
+    long long games = 0, seats[3] = {}, samples = 0, decision_us = 0;
+    uint32_t game = 0;
+    for (const TraceRecord &r : reader)
+    {
+        if (r.ply == 0 || r.game != game || games == 0)
+            games++;
+        game = r.game;
+        seats[r.seat % 3]++;
+        samples += r.samples;
+        decision_us += r.decision_us;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    long long n = reader.size();
+    cout << "records=" << n << " games=" << games << " seats=" << seats[0] << "/" << seats[1] << "/" << seats[2]
+         << " mean_samples=" << (n ? double(samples) / n : 0) << " mean_decision_ms=" << (n ? decision_us / 1000.0 / n : 0)
+         << " records_per_sec=" << (seconds > 0 ? n / seconds : 0) << endl;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    //srand(time(0));
-    srand(0);
+    bool server = false, run_bench = false, bench_alloc = false, keep_running = false;
+    int selfplay_games = 0;
+    int simulate_games = 0;
+    string train_path, train_trace, stats_path, table_path, replay_dir;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--server")
+            server = true;
+        else if (arg == "--bench")
+            run_bench = true;
+        else if (arg == "--bench-alloc")
+            bench_alloc = doudizhu::count_allocations = true;
+        else if (arg == "--alloc-stats")
+            doudizhu::count_allocations = true;
+        else if (arg == "--keep-running")
+            keep_running = true;
+        else if (arg == "--ponder")
+            doudizhu::ponder = true;
+        else if (arg == "--ponder-iterations" && i + 1 < argc)
+            doudizhu::ponder_iterations = max(1, atoi(argv[++i]));
+        else if (arg == "--ponder-samples" && i + 1 < argc)
+            doudizhu::ponder_max_samples = max(0, atoi(argv[++i]));
+        else if (arg == "--action-table" && i + 1 < argc)
+        {
+            if (!doudizhu::action_table.load(argv[++i]))
+                cerr << "failed to load action table " << argv[i] << ", generating moves instead" << endl;
+        }
+        else if (arg == "--build-action-table" && i + 1 < argc)
+            table_path = argv[++i];
+        else if (arg == "--order-moves")
+            doudizhu::order_moves = true;
+        else if (arg == "--puct" && i + 1 < argc)
+            doudizhu::puct_c = max(0.0, atof(argv[++i]));
+        else if (arg == "--rollout")
+            doudizhu::rollout_leaves = true;
+        else if (arg == "--no-simd")
+            doudizhu::sim_use_avx2 = false;
+        else if (arg == "--simulate" && i + 1 < argc)
+            simulate_games = max(1, atoi(argv[++i]));
+        else if (arg == "--fixed-samples")
+            doudizhu::adaptive_determinizations = false;
+        else if (arg == "--pipeline")
+            doudizhu::pipeline_posterior = true;
+        else if (arg == "--root-schedule" && i + 1 < argc)
+            doudizhu::sequential_halving = string(argv[++i]) != "uniform";
+        else if (arg == "--value-model" && i + 1 < argc)
+        {
+            if (!doudizhu::value_model.load(argv[++i]))
+                cerr << "failed to load value model " << argv[i] << ", using the heuristic evaluation" << endl;
+        }
+        else if (arg == "--trace" && i + 1 < argc)
+        {
+            if (!trace_writer.open(argv[++i]))
+                cerr << "failed to open trace " << argv[i] << endl;
+        }
+        else if (arg == "--replay" && i + 1 < argc)
+            replay_dir = argv[++i];
+        else if (arg == "--replay-baseline" && i + 1 < argc)
+            replay_baseline = argv[++i];
+        else if (arg == "--telemetry" && i + 1 < argc)
+        {
+            if (!telemetry_writer.open(argv[++i]))
+                cerr << "failed to open telemetry " << argv[i] << endl;
+        }
+        else if (arg == "--trace-stats" && i + 1 < argc)
+            stats_path = argv[++i];
+        else if (arg == "--selfplay" && i + 1 < argc)
+            selfplay_games = max(1, atoi(argv[++i]));
+        else if (arg == "--train-value" && i + 1 < argc)
+            train_path = argv[++i];
+        else if (arg == "--train-trace" && i + 1 < argc)
+            train_trace = argv[++i];
+        else if (arg == "--train-games" && i + 1 < argc)
+            train_games = max(1, atoi(argv[++i]));
+        else if (arg == "--train-hidden" && i + 1 < argc)
+            train_hidden = max(0, atoi(argv[++i]));
+        else if (arg == "--train-epochs" && i + 1 < argc)
+            train_epochs = max(0, atoi(argv[++i]));
+        else if (arg == "--train-rate" && i + 1 < argc)
+            train_rate = atof(argv[++i]);
+        else if (arg == "--bench-positions" && i + 1 < argc)
+            bench_positions = max(1, atoi(argv[++i]));
+        else if (arg == "--bench-reference" && i + 1 < argc)
+            bench_reference_samples = max(1, atoi(argv[++i]));
+        else if (arg == "--bench-budgets" && i + 1 < argc)
+            bench_budgets = argv[++i];
+        else if (arg == "--bench-threads" && i + 1 < argc)
+            bench_threads = argv[++i];
+        else if (arg == "--seed" && i + 1 < argc)
+            doudizhu::search_seed = strtoull(argv[++i], NULL, 10);
+        else if (arg == "--samples" && i + 1 < argc)
+            doudizhu::det_samples = max(1, atoi(argv[++i]));
+        else if (arg == "--time-budget" && i + 1 < argc)
+            doudizhu::time_budget_ms = max(0.0, atof(argv[++i]));
+        else if (arg == "--iterations" && i + 1 < argc)
+            doudizhu::uct_iterations = max(1, atoi(argv[++i]));
+        else if (arg == "--node-budget" && i + 1 < argc)
+            doudizhu::node_budget = max(0, atoi(argv[++i]));
+        else if (arg == "--leaf-batch" && i + 1 < argc)
+            doudizhu::leaf_batch_size = max(1, atoi(argv[++i]));
+        else if (arg == "--action-cache" && i + 1 < argc)
+            doudizhu::action_cache_capacity = max(0, atoi(argv[++i]));
+        else if (arg == "--threads" && i + 1 < argc)
+            doudizhu::thread_num = max(1, atoi(argv[++i]));
+        else if (arg == "--posterior-eps" && i + 1 < argc)
+            doudizhu::posterior_epsilon = atof(argv[++i]);
+        else if (arg == "--posterior-topk" && i + 1 < argc)
+            doudizhu::posterior_top_k = max(0, atoi(argv[++i]));
+    }
 
-    botzone();
+    if (!table_path.empty())
+    {
+        if (!doudizhu::buildActionTable(table_path))
+            cerr << "failed to build action table " << table_path << endl;
+    }
+    else if (!replay_dir.empty())
+        replay(replay_dir);
+    else if (!stats_path.empty())
+        traceStats(stats_path);
+    else if (!train_path.empty())
+        trainValue(train_path, train_trace);
+    else if (simulate_games > 0)
+        simulateSelfPlay(simulate_games);
+    else if (selfplay_games > 0)
+        selfPlayGames(selfplay_games);
+    else if (run_bench)
+        bench();
+    else if (bench_alloc)
+        benchAllocations();
+    else if (server)
+        serve();
+    else if (keep_running)
+        keepRunning();
+    else
+        botzone();
 
     return 0;
 }